@@ -27,11 +27,158 @@
 /* #include "llvm/Transforms/Utils/Cloning.h" */
 /* #include "llvm/Transforms/Utils/LoopUtils.h" */
 
+#include "llvm/Analysis/InstructionSimplify.h"
 #include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include <mutex>
 using namespace llvm;
 
 #define DEBUG_TYPE "lqicm"
 
+static cl::opt<bool>
+EnablePeel("lqicm-peel", cl::init(false), cl::Hidden,
+           cl::desc("Peel loops regarding to the invariance degrees and remove "
+                    "the quasi-invariant chunks from the remaining body"));
+
+static cl::opt<bool>
+EnablePeelMetadata("lqicm-peel-metadata", cl::init(false), cl::Hidden,
+                   cl::desc("Only attach llvm.loop.peel.count to the loops "
+                            "and let the upstream peeling and LICM transform "
+                            "them"));
+
+static cl::opt<bool>
+EnableDegreeMetadata("lqicm-degree-metadata", cl::init(false), cl::Hidden,
+                     cl::desc("Write the degrees computed as !lqicm.degree "
+                              "and llvm.loop.lqicm.degree metadata"));
+
+static cl::opt<bool>
+EnableChunkHoist("lqicm-hoist-chunks", cl::init(false), cl::Hidden,
+                 cl::desc("Hoist the invariant inner loops and forks of a "
+                          "loop in its preheader"));
+
+static cl::opt<bool>
+EnableNestHoist("lqicm-hoist-nest", cl::init(false), cl::Hidden,
+                cl::desc("Hoist the invariant chunks of a loop nest out of "
+                         "all the levels where they are invariant"));
+
+static cl::opt<bool>
+EnablePostPeelHoist("lqicm-post-peel-hoist", cl::init(true), cl::Hidden,
+                    cl::desc("Hoist and sink the instructions made invariant "
+                             "by a peeling and simplify the peeled blocks"));
+
+static cl::opt<bool>
+EnableSlicePeel("lqicm-peel-slice", cl::init(false), cl::Hidden,
+                cl::desc("Peel only the slice computing the quasi-invariant "
+                         "instructions when they have no side effect"));
+
+static cl::opt<std::string>
+ReportFile("lqicm-report", cl::init(""), cl::Hidden,
+           cl::value_desc("file"),
+           cl::desc("Append a JSON record per loop to this file"));
+
+static cl::opt<bool>
+TimePhases("lqicm-time-phases", cl::init(false), cl::Hidden,
+           cl::desc("Keep the time of each phase of each loop, in the "
+                    "-lqicm-report records and for the benchmarks"));
+
+static cl::opt<unsigned>
+MaxLoopInsts("lqicm-max-loop-insts", cl::init(2000), cl::Hidden,
+             cl::desc("Don't analyze loops with more instructions out of "
+                      "their inner loops (0 for no limit)"));
+
+static cl::opt<unsigned>
+MaxRelationVariables("lqicm-max-variables", cl::init(1000), cl::Hidden,
+                     cl::desc("Give up a loop when a relation has more "
+                              "variables (0 for no limit)"));
+
+static cl::opt<unsigned>
+MaxRelationArrows("lqicm-max-arrows", cl::init(100000), cl::Hidden,
+                  cl::desc("Give up a loop when a composition has more "
+                           "arrows (0 for no limit)"));
+
+static cl::opt<unsigned>
+MaxFixPointRounds("lqicm-max-fixpoint-rounds", cl::init(64), cl::Hidden,
+                  cl::desc("Give up a loop when its fixpoint needs more "
+                           "rounds (0 for no limit)"));
+
+static cl::opt<unsigned>
+MaxDepSteps("lqicm-max-dep-steps", cl::init(1000000), cl::Hidden,
+            cl::desc("Give up a loop when the search of the dependencies of "
+                     "its chunks takes more steps (0 for no limit)"));
+
+static cl::opt<bool>
+EnableMemoize("lqicm-memoize", cl::init(false), cl::Hidden,
+              cl::desc("Skip at runtime the variant pure inner loops and "
+                       "forks whose inputs did not change since their last "
+                       "run"));
+
+static cl::opt<unsigned>
+MemoizeMinCost("lqicm-memoize-min-cost", cl::init(40), cl::Hidden,
+               cl::desc("Minimum size (target cost) of a memoized chunk"));
+
+static cl::opt<unsigned>
+MemoizeMaxInputs("lqicm-memoize-max-inputs", cl::init(4), cl::Hidden,
+                 cl::desc("Maximum number of inputs compared to skip a "
+                          "memoized chunk"));
+
+static cl::opt<bool>
+EnableSplit("lqicm-split", cl::init(false), cl::Hidden,
+            cl::desc("Split loops in a prologue running as many iterations as "
+                     "their degree and a main loop without their "
+                     "quasi-invariant chunks (preferred to peeling above "
+                     "degree 1)"));
+
+static cl::opt<bool>
+EnableVersioning("lqicm-version", cl::init(false), cl::Hidden,
+                 cl::desc("Peel only a version of the loop guarded by a "
+                          "trip count above the degree, the original loop "
+                          "runs otherwise"));
+
+static cl::opt<bool>
+EnableUnswitch("lqicm-unswitch", cl::init(false), cl::Hidden,
+               cl::desc("Unswitch peeled loops on the conditions of their "
+                        "quasi-invariant forks"));
+
+static cl::opt<unsigned>
+UnswitchMaxCount("lqicm-unswitch-max-count", cl::init(2), cl::Hidden,
+                 cl::desc("Maximum number of forks unswitched in a loop"));
+
+static cl::opt<unsigned>
+UnswitchThreshold("lqicm-unswitch-threshold", cl::init(400), cl::Hidden,
+                  cl::desc("Maximum size (target cost) of all the versions "
+                           "of an unswitched loop"));
+
+static cl::opt<unsigned>
+PeelMaxCount("lqicm-peel-max-count", cl::init(8), cl::Hidden,
+             cl::desc("Maximum number of iterations peeled off a loop"));
+
+static cl::opt<unsigned>
+PeelBudget("lqicm-peel-budget", cl::init(400), cl::Hidden,
+           cl::desc("Maximum size (target cost) of the code cloned by peeling "
+                    "a loop"));
+
+static cl::opt<unsigned>
+PeelOptSizeBudget("lqicm-peel-optsize-budget", cl::init(40), cl::Hidden,
+                  cl::desc("Peel budget when optimizing for size (-Os), "
+                           "there is no peeling at -Oz"));
+
+static cl::opt<unsigned>
+PeelTripCountFactor("lqicm-peel-trip-count-factor", cl::init(4), cl::Hidden,
+                    cl::desc("Peel only loops whose expected trip count is at "
+                             "least this factor times the peel count"));
+
+static cl::opt<uint64_t>
+ColdLoopCount("lqicm-cold-loop-count", cl::init(16), cl::Hidden,
+              cl::desc("With profile data, skip loops whose header runs "
+                       "fewer times than this"));
+
+static cl::opt<unsigned>
+PeelUnknownTripCount("lqicm-peel-unknown-trip-count", cl::init(16), cl::Hidden,
+                     cl::desc("Trip count assumed by the peeling cost model "
+                              "when it is unknown"));
+
 
 // Function from LQICM
 /* static bool inSubLoop(BasicBlock *BB, Loop *CurLoop, LoopInfo *LI); */
@@ -54,6 +201,11 @@ CloneInstructionInExitBlock(Instruction &I, BasicBlock &ExitBlock, PHINode &PN,
                             const LoopSafetyInfo *SafetyInfo);/*}-}*/
 
 // Our functions
+static unsigned simplifyPeeledBlocks(Function &F,
+                                     const SmallPtrSetImpl<BasicBlock*> &Old,
+                                     DominatorTree* DT);
+static unsigned hoistAfterPeel(Loop* L, AliasAnalysis* AA, LoopInfo* LI,
+                               DominatorTree* DT);
 static bool isWellFormedFork(BasicBlock* Then, BasicBlock* Else, Loop* CurLoop,
                              PostDominatorTree* PDT, DominatorTree* DT);
 static Relation* computeRelationLoop(DomTreeNode *N, MapChunk* mapChunk,
@@ -61,8 +213,8 @@ static Relation* computeRelationLoop(DomTreeNode *N, MapChunk* mapChunk,
                                      DominatorTree *DT, Loop *CurLoop,
                                      AliasSetTracker *CurAST, LoopSafetyInfo
                                      *SafetyInfo, DependenceInfo *DI,
-                                     PostDominatorTree *PDT, std::vector<Value*>
-                                     *OC);
+                                     PostDominatorTree *PDT, RegionInfo *RI,
+                                     std::vector<Value*> *OC);
 
 VSet searchForDependedRelations(Relation* RI, MapRel* mapRel, Value* end);
 
@@ -192,7 +344,7 @@ static Relation* computeRelation(BasicBlock* BB, MapDeg* mapDeg , MapRel*
         (*mapDeg)[&I]=0;
       else {
         (*mapDeg)[&I]=-1;
-        if(!isa<BranchInst>(&I) || isExiting)
+        if(!(isa<BranchInst>(&I) || isa<SwitchInst>(&I)) || isExiting)
           RB->setAnchor(true);
       }
       OC->push_back(&I);
@@ -289,6 +441,7 @@ static int computeDeg(Chunk* chunk, Value* I, DominatorTree *DT, Value *head,
   MapDeg* mapDeg = chunk->getMapDeg();
   MapRel* mapRel = chunk->getMapRel();
   DEBUG(dbgs() << " Computation degree of " << *I << '\n');
+  ++getAnalysisState().Counters.ComputeDegCalls;
   if((*mapDeg)[I]){
     DEBUG(dbgs() << "\n\tAlready in mapDeg with deg = " << (*mapDeg)[I] << '\n');
     return (*mapDeg)[I];
@@ -420,9 +573,14 @@ VNode* searchForFirstComWithVAsOutputInOC(Value* V, MapRel* mapRel,
 }
 
 VSet computeDepForX(VNode* head, Value* X, MapRel* mapRel,
-                    std::vector<Value*> *OC){
-  VNode* Cj = searchForFirstComWithVAsOutputInOC(X,mapRel,head);
+                    std::vector<Value*> *OC, unsigned Depth = 1){
+  AnalysisState &State = getAnalysisState();
+  updateMax(State.Counters.DepForXDepth, Depth);
   VSet relations;
+  if(!State.Budget.check(++State.Budget.DepSteps, State.Budget.MaxDepSteps,
+                         "dependency search steps"))
+    return relations;
+  VNode* Cj = searchForFirstComWithVAsOutputInOC(X,mapRel,head);
 
   //If there is no dep return empty set
   if(Cj==nullptr)
@@ -448,7 +606,8 @@ VSet computeDepForX(VNode* head, Value* X, MapRel* mapRel,
         if(mapRel->count(Y)){
           /* DEBUG(dbgs()<<"\tRec call of computeDepForX… on %"
            * << Y->getName() << '\n'); */
-          relations=mergeVSet(relations,computeDepForX(Cj->getNext(),Y,mapRel,OC));
+          relations=mergeVSet(relations,computeDepForX(Cj->getNext(),Y,mapRel,
+                                                       OC,Depth + 1));
           onlyPropOutside = false;
         } 
       }
@@ -564,6 +723,40 @@ static bool isWellFormedFork(BasicBlock* Then, BasicBlock* Else, Loop* CurLoop,
   else{
     DEBUG(dbgs() << "Break of the loop somewhere " <<  " … " << '\n');
   }
+  return false;
+}/*}-}*/
+
+// Return the end of the fork starting at BB, nullptr if it's not a chunk/*{-{*/
+// The fork is closed by the smallest SESE region entered by BB when the
+// RegionInfo is available. This way switches and diamonds of any width are
+// managed. Otherwise only two-way branches are closed with the common
+// postdominator.
+static BasicBlock* getForkEnd(BasicBlock* BB, Loop* CurLoop, RegionInfo* RI,
+                              PostDominatorTree* PDT, DominatorTree* DT){
+  if(RI){
+    // If a region starts with BB it's the innermost one containing BB
+    Region* R = RI->getRegionFor(BB);
+    if(R && R->getEntry() == BB && R->getExit()){
+      BasicBlock* Exit = R->getExit();
+      DEBUG(dbgs() << " INFO: SESE region " << R->getNameStr() << '\n');
+      // The region has to stay in the body of the current iteration
+      if(CurLoop->contains(Exit) && Exit != CurLoop->getHeader() &&
+         !R->contains(CurLoop->getHeader())){
+        NumRegionForks++;
+        return Exit;
+      }
+      DEBUG(dbgs() << " WARN: region leaves the body of the loop " << '\n');
+    }
+  }
+
+  TerminatorInst *TInst = BB->getTerminator();
+  if(TInst->getNumSuccessors() != 2)
+    return nullptr;
+  BasicBlock *Then = TInst->getSuccessor(0);
+  BasicBlock *Else = TInst->getSuccessor(1);
+  if(isWellFormedFork(Then,Else,CurLoop,PDT,DT))
+    return PDT->findNearestCommonDominator(Then,Else);
+  return nullptr;
 }/*}-}*/
 
 // Return the first BB in the Body of the current loop
@@ -595,7 +788,8 @@ static Relation* computeRelationBBInLoop(BasicBlock *BB, BasicBlock *End,
                                          *CurLoop, AliasSetTracker *CurAST,
                                          LoopSafetyInfo *SafetyInfo,
                                          DependenceInfo *DI, PostDominatorTree
-                                         *PDT, std::vector<Value*> *OC){
+                                         *PDT, RegionInfo *RI,
+                                         std::vector<Value*> *OC){
   DEBUG(dbgs() << "\n---- computeRelationBBInLoop ----\n ");
   DEBUG(dbgs() << "INFO ---- BB = " << *BB <<'\n');
   DEBUG(dbgs() << "INFO ---- End = " << *End <<'\n');
@@ -604,6 +798,7 @@ static Relation* computeRelationBBInLoop(BasicBlock *BB, BasicBlock *End,
 
   if(BB == End){
     EndUnexpected++;
+    getAnalysisState().Abort.set("end of the chunk reached unexpectedly", BB);
     DEBUG(errs() << "ERROR ---- BB = End it shouldn't be! \n");
     return nullptr;
   }
@@ -629,6 +824,7 @@ static Relation* computeRelationBBInLoop(BasicBlock *BB, BasicBlock *End,
     DEBUG(dbgs() << "---- Not In Current Loop " << '\n');
     // Return empty Relation
     BBNotInCurrentLoop++;
+    getAnalysisState().Abort.set("block out of the loop", BB);
     /* return RB; */
     return nullptr;
   }
@@ -649,6 +845,7 @@ static Relation* computeRelationBBInLoop(BasicBlock *BB, BasicBlock *End,
           DEBUG(errs() << " ERROR! Inner Loop non analyzed → abort" <<
                 InnerHead->getName() <<'\n');
           InnerLoopNotAnalysed++;
+          getAnalysisState().Abort.set("inner loop not analyzed", InnerHead);
           return nullptr;
         } else {
           Chunk* innerLoopChunk = (*mapChunk)[InnerHead];
@@ -656,6 +853,7 @@ static Relation* computeRelationBBInLoop(BasicBlock *BB, BasicBlock *End,
             DEBUG(dbgs() << " ERROR! Relation not found for Loop with Head = " <<
                   InnerHead <<'\n');
             InnerLoopNotAnalysed++;
+            getAnalysisState().Abort.set("inner loop not analyzed", InnerHead);
             // FIXME should throw an exception or just stop the analysis here
             return nullptr;
           }
@@ -688,7 +886,7 @@ static Relation* computeRelationBBInLoop(BasicBlock *BB, BasicBlock *End,
                                                       mapChunk, currentChunk,
                                                       AA, LI, DT, CurLoop,
                                                       CurAST, SafetyInfo, DI,
-                                                      PDT, OC);
+                                                      PDT, RI, OC);
             if(RWEND)
               RB = RL->composition(RWEND);
             else {
@@ -747,7 +945,7 @@ static Relation* computeRelationBBInLoop(BasicBlock *BB, BasicBlock *End,
               WhileEnd->getName() << '\n');
         Relation* RWEND = computeRelationBBInLoop(WhileEnd, End, RPHI, mapChunk,
                                                   currentChunk, AA, LI, DT, CurLoop,
-                                                  CurAST, SafetyInfo, DI, PDT,
+                                                  CurAST, SafetyInfo, DI, PDT, RI,
                                                   OC);
         if(RWEND)
           return RWEND;
@@ -806,6 +1004,7 @@ static Relation* computeRelationBBInLoop(BasicBlock *BB, BasicBlock *End,
       Succ = Else;
     else {//FIXME maybe if both are going in while.end we can say it's a latch?
       ForkWithTwoBreak++;
+      getAnalysisState().Abort.set("fork with two exits of the loop", TInst);
       DEBUG(errs() << " ERROR: Loop form not managed yet… " << BB->getName() << '\n');
       return nullptr;
     }
@@ -817,155 +1016,109 @@ static Relation* computeRelationBBInLoop(BasicBlock *BB, BasicBlock *End,
       Succ = BB->getUniqueSuccessor();
   }
 
-  // TODO if more than 2 we should manage by checking the commonPostDominator
-  // and compute the sum anyway
-  // FIXME Maybe using BranchInst information
-  if(nbSucc==2){
-    BasicBlock *Then = TInst->getSuccessor(0);
-    BasicBlock *Else = TInst->getSuccessor(1);
-    if(isWellFormedFork(Then,Else,CurLoop,PDT,DT)){
-      BasicBlock *IfEnd = PDT->findNearestCommonDominator(Then,Else);
+  // Forks (if-then-else, switch…) are closed by their SESE region, each
+  // successor is a branch and the fork relation is the sum of them
+  if(nbSucc>=2){
+    BasicBlock *IfEnd = getForkEnd(BB,CurLoop,RI,PDT,DT);
+    if(IfEnd){
       DEBUG(dbgs() << " INFO: Exit If Block of if is :" << IfEnd->getName() <<
             '\n');
 
       if(!CurLoop->contains(IfEnd)){
         BranchWithBreakUnexpected++;
+        getAnalysisState().Abort.set("fork closed out of the loop", TInst);
         DEBUG(errs() << " ERROR: Exit If Block out of the loop! \n");
         return nullptr;
       }
+      if(isa<SwitchInst>(TInst))
+        NumSwitchForks++;
 
       // No deg computed inside. Only the relation of if matters
-      // One Relation for each branch
-      // DEPRECATED
-      /* MapRel *mapThenRel = new MapRel(); */
-      /* MapRel *mapElseRel = new MapRel(); */
       std::vector<Value*> OCif;
 
-      Value* VThen = dyn_cast<Value>(Then);
-      Value* VElse = dyn_cast<Value>(Else);
-
-      // Every relations of the branches will be in the corresponding map
-      Chunk* ThenChunk = new Chunk(Then->getName()); // Creates mapRel
-      ThenChunk->setStart(Then);
-      ThenChunk->setEnd(IfEnd);
-      ThenChunk->setType(Chunk::BRANCH);
-
-      Chunk* ElseChunk = new Chunk(Else->getName()); // Creates mapRel
-      ElseChunk->setStart(Else);
-      ElseChunk->setEnd(IfEnd);
-      ElseChunk->setType(Chunk::BRANCH);
-
-      // DEPRECATED
-      /* (*mapChunkRel)[VThen] = mapThenRel; */
-      /* (*mapChunkRel)[VElse] = mapElseRel; */
-
-      // it could have some phi to take into account! IMPORTANT
-      DEBUG(dbgs() << " Computing RThenPHI : " << Then->getName() << " to " <<
-            IfEnd->getName() << '\n');
-      Relation *RThenPHI = new Relation();
-      if(Then != IfEnd)
-        RThenPHI = getPHIRelations(BB,Then,mapRel,OC);
-
-      DEBUG(dbgs() << " Computing RElsePHI : " << Then->getName() << " to " <<
-            IfEnd->getName() << '\n');
-      Relation *RElsePHI = new Relation();
-      if(Else != IfEnd)
-        RElsePHI = getPHIRelations(BB,Else,mapRel,OC);
-
-
-      // Recursive call on each branch
-      Relation* RThen = new Relation();
-      DEBUG(dbgs() << " Computing RThen : " << Then->getName() << " to " <<
-            IfEnd->getName() << '\n');
-
-      // DEPRECATED
-      /* RThen->setStart(Then); */
-      /* RThen->setEnd(IfEnd); */
-      /* RThen->setBranch(true); */
-      if(Then != IfEnd){
-        (*mapChunk)[VThen] = ThenChunk;
-        RThen = computeRelationBBInLoop(Then, IfEnd, RPHI, mapChunk,
-                                        ThenChunk, AA, LI, DT, CurLoop,
-                                        CurAST, SafetyInfo, DI, PDT, &OCif);
-      }
-      if(!RThen){
-        DEBUG(errs() << " ERROR in RThen of: " << Then->getName() << '\n');
-        ThenChunk->setType(Chunk::ERROR);
-        return nullptr;
-      }
-      DEBUG(dbgs() << " Then : " << Then->getName() << '\n');
-      DEBUG(RThen->dump(dbgs()));
-      ThenChunk->setRel(RThen);
-
-      Relation* RElse = new Relation();
-      // DEPRECATED
-      /* RElse->setStart(Else); */
-      /* RElse->setEnd(IfEnd); */
-      /* RElse->setBranch(true); */
-      DEBUG(dbgs() << " Computing RElse : " << Else->getName() << " to " <<
-            IfEnd->getName() << '\n');
-      if(Else != IfEnd){
-        (*mapChunk)[VElse] = ElseChunk;
-        RElse = computeRelationBBInLoop(Else, IfEnd, RPHI, mapChunk,
-                                        ElseChunk, AA, LI, DT, CurLoop,
-                                        CurAST, SafetyInfo, DI, PDT, &OCif);
-      }
+      // The sum will be added here, key = to TInst
+      // FIXME Should we take the entire block with the TInst in the chunk?
+      Chunk* branChunk = new Chunk(TInst->getName());
+      branChunk->setStart(BB);
+      branChunk->setEnd(IfEnd);
+      branChunk->setType(Chunk::FORK);
+      branChunk->setDegree(0);
 
-      if(!RElse){
-        DEBUG(errs() << " ERROR in RElse of: " << Else->getName() << '\n');
-        ElseChunk->setType(Chunk::ERROR);
-        return nullptr;
+      Relation *RSum = nullptr;
+      BSet visited;
+      for(unsigned i = 0; i < nbSucc; ++i){
+        BasicBlock *Branch = TInst->getSuccessor(i);
+        // Several cases of a switch can share the same destination
+        if(!visited.insert(Branch).second)
+          continue;
+        Value* VBranch = dyn_cast<Value>(Branch);
+
+        // Every relations of the branch will be in the corresponding map
+        Chunk* BranchChunk = new Chunk(Branch->getName()); // Creates mapRel
+        BranchChunk->setStart(Branch);
+        BranchChunk->setEnd(IfEnd);
+        BranchChunk->setType(Chunk::BRANCH);
+
+        // it could have some phi to take into account! IMPORTANT
+        DEBUG(dbgs() << " Computing RBranchPHI : " << Branch->getName() <<
+              " to " << IfEnd->getName() << '\n');
+        Relation *RBranchPHI = new Relation();
+        if(Branch != IfEnd)
+          RBranchPHI = getPHIRelations(BB,Branch,mapRel,OC);
+
+        // Recursive call on each branch
+        Relation* RBranch = new Relation();
+        DEBUG(dbgs() << " Computing RBranch : " << Branch->getName() <<
+              " to " << IfEnd->getName() << '\n');
+        if(Branch != IfEnd){
+          (*mapChunk)[VBranch] = BranchChunk;
+          RBranch = computeRelationBBInLoop(Branch, IfEnd, RPHI, mapChunk,
+                                            BranchChunk, AA, LI, DT, CurLoop,
+                                            CurAST, SafetyInfo, DI, PDT, RI,
+                                            &OCif);
+        }
+        if(!RBranch){
+          DEBUG(errs() << " ERROR in RBranch of: " << Branch->getName() <<
+                '\n');
+          BranchChunk->setType(Chunk::ERROR);
+          return nullptr;
+        }
+        DEBUG(dbgs() << " Branch : " << Branch->getName() << '\n');
+        DEBUG(RBranch->dump(dbgs()));
+        BranchChunk->setRel(RBranch);
+
+        // Add Phi entries
+        DEBUG(dbgs() << " Composition RBranchPHI ↓ " << Branch->getName());
+        DEBUG(RBranchPHI->dump(dbgs()));
+        RBranch = RBranchPHI->composition(RBranch);
+        // usefull ? ↓
+        (*branChunk->getMapRel())[VBranch] = RBranch;
+
+        // Sum branchs
+        if(!RSum){
+          RBranch->setEnd(IfEnd);
+          RBranch->setBranch(true);
+          RSum = RBranch;
+        } else
+          RSum = RSum->sumRelation(RBranch);
       }
-      DEBUG(dbgs() << " Else : " << Else->getName() << '\n');
-      DEBUG(RElse->dump(dbgs()));
-      ElseChunk->setRel(RElse);
-
-      // Add Phi entries
-      DEBUG(dbgs() << " Composition RThenPHI ↓ " << Then->getName());
-      DEBUG(RThenPHI->dump(dbgs()));
-      DEBUG(dbgs() << " With RThen ↓ " << Then->getName());
-      DEBUG(RThen->dump(dbgs()));
-      RThen = RThenPHI->composition(RThen);
-
-      DEBUG(dbgs() << " Composition RElsePHI ↓ " << Else->getName());
-      DEBUG(RElsePHI->dump(dbgs()));
-      DEBUG(dbgs() << " With RElse ↓ " << Else->getName());
-      DEBUG(RElse->dump(dbgs()));
-      RElse = RElsePHI->composition(RElse);
-
 
       Relation *RFork = new Relation();
-      RThen->setEnd(IfEnd);
-      RThen->setBranch(true);
-
-      // Sum branchs
-      RFork = RFork->composition(RThen->sumRelation(RElse));
+      RFork = RFork->composition(RSum);
 
       // Here RB is the relation of the If but we need to add conditions dep
       Relation *RCMP = getCondRelationsFromBB(BB,mapRel);
       if(RCMP)
         RFork->addDependencies(RCMP->getIn(),RFork->getOut());
 
-      DEBUG(dbgs() << " FINAL Branch from " << TInst << '\n');
+      DEBUG(dbgs() << " FINAL Branch from " << TInst << '\n');
       DEBUG(RFork->dump(dbgs()));
 
       (*mapDeg)[TInst] = 0;
       (*mapRel)[TInst] = RFork;
-      // Is this useless?
-      // The sum will be added here, key = to TInst
-      // FIXME Should we take the entire block with the TInst in the chunk?
-      Chunk* branChunk = new Chunk(TInst->getName());
-      branChunk->setStart(BB);
-      branChunk->setEnd(IfEnd);
       branChunk->setRel(RFork);
-      branChunk->setDegree(0);
-      // usefull ? ↓
-      (*branChunk->getMapRel())[VThen] = RThen;
-      (*branChunk->getMapRel())[VElse] = RElse;
-
+      branChunk->setAnchor(RFork->isAnchor());
       (*mapChunk)[TInst] = branChunk;
-      /* (*mapChunkRel)[TInst] = new MapRel(); */
-      /* (*(*mapChunkRel)[TInst])[TInst] = RFork; */
 
       RB = RB->composition(RFork);
 
@@ -974,7 +1127,7 @@ static Relation* computeRelationBBInLoop(BasicBlock *BB, BasicBlock *End,
                                                       mapChunk, currentChunk,
                                                       AA, LI, DT, CurLoop,
                                                       CurAST, SafetyInfo, DI,
-                                                      PDT, OC);
+                                                      PDT, RI, OC);
         if(!Rcontinue){
           DEBUG(dbgs() << " ERROR in Rcontinue of: " << IfEnd << '\n');
           return nullptr;
@@ -1023,7 +1176,7 @@ static Relation* computeRelationBBInLoop(BasicBlock *BB, BasicBlock *End,
       Relation* Rnext = computeRelationBBInLoop(Succ, End, RPHI, mapChunk,
                                                 currentChunk, AA, LI, DT,
                                                 CurLoop, CurAST, SafetyInfo, DI,
-                                                PDT, OC);
+                                                PDT, RI, OC);
       if(!Rnext){
         DEBUG(errs() << " ERROR in Rnext of: " << *Succ << '\n');
         return nullptr;
@@ -1034,6 +1187,7 @@ static Relation* computeRelationBBInLoop(BasicBlock *BB, BasicBlock *End,
     DEBUG(errs() << " ERROR Several successors for with one exiting " << *BB << '\n');
     DEBUG(errs() << " ERROR: Loop form not managed yet… " << BB->getName() << '\n');
     WeirdTermination++;
+    getAnalysisState().Abort.set("exiting block with several successors", BB);
     return nullptr;
   }
 
@@ -1046,8 +1200,8 @@ static Relation* computeRelationLoop(DomTreeNode *N, MapChunk* mapChunk,
                                      DominatorTree *DT, Loop *CurLoop,
                                      AliasSetTracker *CurAST, LoopSafetyInfo
                                      *SafetyInfo, DependenceInfo *DI,
-                                     PostDominatorTree *PDT,std::vector<Value*>
-                                     *OC) {
+                                     PostDominatorTree *PDT, RegionInfo *RI,
+                                     std::vector<Value*> *OC) {
 
     DEBUG(dbgs() <<"\n************ComputeRelationLoop***********\n");
     BasicBlock* Head = CurLoop->getHeader();
@@ -1056,6 +1210,7 @@ static Relation* computeRelationLoop(DomTreeNode *N, MapChunk* mapChunk,
       if(!CurLoop->isLoopExiting(Head)){
         DEBUG(dbgs() <<"WARN: not well formed for this analysis → Abort");
         NumLoopsWithExitNotInHead++;
+        getAnalysisState().Abort.set("exit not in the header", Head);
         /* Relation* RL = new Relation(Head); */
         /* return RL; */
         return nullptr;
@@ -1063,17 +1218,25 @@ static Relation* computeRelationLoop(DomTreeNode *N, MapChunk* mapChunk,
 
       Chunk* loopChunk = (*mapChunk)[head];
 
-      Relation *RPHI = getPHIRelations(CurLoop,loopChunk->getMapRel(),false,OC);
+      Relation *RPHI;
+      {
+        PhaseTimer T("phi", "PHI relations", CurLoop);
+        RPHI = getPHIRelations(CurLoop,loopChunk->getMapRel(),false,OC);
+      }
       BasicBlock *FirstBody = getFirstBodyOfLoop(CurLoop);
       Relation *RL;
-      if(FirstBody!=Head)
-        RL = computeRelationBBInLoop(FirstBody, Head, RPHI, mapChunk,
-                                             loopChunk, AA, LI, DT, CurLoop,
-                                             CurAST, SafetyInfo, DI, PDT, OC);
-      else
-        RL = computeRelation(Head, loopChunk->getMapDeg(),
-                                       loopChunk->getMapRel(), AA, DT, CurLoop,
-                                       CurAST, SafetyInfo, OC, false);
+      {
+        PhaseTimer T("body", "Body relation", CurLoop);
+        if(FirstBody!=Head)
+          RL = computeRelationBBInLoop(FirstBody, Head, RPHI, mapChunk,
+                                       loopChunk, AA, LI, DT, CurLoop,
+                                       CurAST, SafetyInfo, DI, PDT, RI,
+                                       OC);
+        else
+          RL = computeRelation(Head, loopChunk->getMapDeg(),
+                               loopChunk->getMapRel(), AA, DT, CurLoop,
+                               CurAST, SafetyInfo, OC, false);
+      }
       if(!RL){
         return nullptr;
       }
@@ -1083,7 +1246,10 @@ static Relation* computeRelationLoop(DomTreeNode *N, MapChunk* mapChunk,
 
       // Take the while.end into account
       DEBUG(dbgs() << " Fixpoint…" << '\n');
-      RL = fixPoint(RL);
+      {
+        PhaseTimer T("fixpoint", "Fixpoint", CurLoop);
+        RL = fixPoint(RL);
+      }
       DEBUG(RL->dump(dbgs()));
 
       Relation *RCMP = getCondRelationsFromBB(Head,loopChunk->getMapRel());
@@ -1098,9 +1264,14 @@ static Relation* computeRelationLoop(DomTreeNode *N, MapChunk* mapChunk,
       /* (*(*mapChunkRel)[head])[head]=RL; */
 
       DepMapChunks depMap;
-      if(!computeDepChunks(loopChunk,OC,&depMap)){
-        ErrorInDep++;
-        return nullptr;
+      {
+        PhaseTimer T("depchunks", "Dependencies of the chunks", CurLoop);
+        if(!computeDepChunks(loopChunk,OC,&depMap)){
+          ErrorInDep++;
+          getAnalysisState().Abort.set("dependencies of the chunks not "
+                                       "computed", Head);
+          return nullptr;
+        }
       }
 
       //get first not phi value of OC 
@@ -1111,7 +1282,15 @@ static Relation* computeRelationLoop(DomTreeNode *N, MapChunk* mapChunk,
       DEBUG(dbgs() << " ----- Reversed Linked List ----- \n");
       Nhead->dump();
 
-      computeDegOC(loopChunk, Nhead, OC, DT, head, &depMap);
+      {
+        PhaseTimer T("degrees", "Degrees", CurLoop);
+        computeDegOC(loopChunk, Nhead, OC, DT, head, &depMap);
+      }
+      addToHistogram(getAnalysisState().Counters.OCLengths, OC->size(), 16, 4);
+      // The forks of this loop get the degree of their terminator
+      for(Value* V : *OC)
+        if(isa<TerminatorInst>(V) && mapChunk->count(V))
+          (*mapChunk)[V]->setDegree((*loopChunk->getMapDeg())[V]);
       DEBUG(dbgs() << " MapDeg in chunk " << loopChunk->getName() << '\n');
       dumpMapDegOfOC(mapChunk,loopChunk->getMapDeg(),OC,dbgs());
 
@@ -1134,11 +1313,17 @@ PreservedAnalyses LQICMPass::run(Loop &L, LoopStandardAnalysisResults &AR,/*{-{*
   /* auto *TLI = FAM.getCachedResult<TargetLibraryAnalysis>(*F); */
   auto *DI = FAM.getCachedResult<DependenceAnalysis>(*F);
   auto *PDT = FAM.getCachedResult<PostDominatorTreeAnalysis>(*F);
+  auto *RI = FAM.getCachedResult<RegionInfoAnalysis>(*F);
+  auto *TTI = FAM.getCachedResult<TargetIRAnalysis>(*F);
+  auto *BFI = FAM.getCachedResult<BlockFrequencyAnalysis>(*F);
+  OptimizationRemarkEmitter ORE(F);
   auto *SE = FAM.getCachedResult<ScalarEvolutionAnalysis>(*F);
   assert((AA && LI && DT && SE) && "Analyses for LICM not available");
 
   LoopInvariantCodeMotion LICM;
-  bool changed = LICM.runOnLoop(&L, AA, LI, DT, DI, PDT, SE, true);
+  // PDT and RI are invalidated by the analysis manager when the loop changes
+  bool changed = LICM.runOnLoop(&L, AA, LI, DT, DI, PDT, RI, []{}, SE, TTI,
+                                 BFI, &ORE, true);
 
   if (!changed)
     return PreservedAnalyses::all();
@@ -1157,16 +1342,29 @@ INITIALIZE_PASS_DEPENDENCY(LoopPass)
 INITIALIZE_PASS_DEPENDENCY(AAResultsWrapperPass)
 INITIALIZE_PASS_DEPENDENCY(DependenceAnalysisWrapperPass)
 INITIALIZE_PASS_DEPENDENCY(PostDominatorTreeWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(TargetTransformInfoWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(DominanceFrontierWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(RegionInfoPass)
 INITIALIZE_PASS_DEPENDENCY(LoopInfoWrapperPass)
 // initialize all passes which your pass needs
 INITIALIZE_PASS_END(LegacyLQICMPass, "lqicm", "Loop quasi-Invariant Code Motion", false, false)
 
-/* Pass *llvm::createLQICMPass() { return new LegacyLQICMPass(); } */
+char LegacyLQICMPeelPass::ID = 0;
+INITIALIZE_PASS_BEGIN(LegacyLQICMPeelPass, "lqicm-peel-annotated",
+                      "Peel the loops annotated by LQICM", false, false)
+INITIALIZE_PASS_DEPENDENCY(LoopPass)
+INITIALIZE_PASS_END(LegacyLQICMPeelPass, "lqicm-peel-annotated",
+                    "Peel the loops annotated by LQICM", false, false)
 
+Pass *llvm::createLQICMPass() { return new LegacyLQICMPass(); }
 
-// An other way to register the pass…
-static void registerLQICMPass(const PassManagerBuilder &,
-                              legacy::PassManagerBase &PM){
+StringMap<double> llvm::takeLQICMPhaseTimes(){/*{-{*/
+  StringMap<double> Times;
+  std::swap(Times, PhaseTotals);
+  return Times;
+}/*}-}*/
+
+void llvm::addLQICMPasses(legacy::PassManagerBase &PM){/*{-{*/
   PM.add(createPromoteMemoryToRegisterPass());
   PM.add(createIndVarSimplifyPass());
   /* PM.add(createLoopUnrollPass()); */
@@ -1174,13 +1372,127 @@ static void registerLQICMPass(const PassManagerBuilder &,
   PM.add(new AAResultsWrapperPass());
   PM.add(new DependenceAnalysisWrapperPass());
   PM.add(new PostDominatorTreeWrapperPass());
+  PM.add(new RegionInfoPass());
   PM.add(new LoopInfoWrapperPass());
   PM.add(new LegacyLQICMPass());
+  // The upstream transforms run on the loops annotated by the analysis
+  if(EnablePeelMetadata){
+    PM.add(createLoopRotatePass());
+    PM.add(new LegacyLQICMPeelPass());
+    PM.add(createLICMPass());
+  }
+}/*}-}*/
+
+// An other way to register the pass…
+static void registerLQICMPass(const PassManagerBuilder &,
+                              legacy::PassManagerBase &PM){
+  addLQICMPasses(PM);
 }
 static RegisterStandardPasses
 //FIXME Where should we put this pass?
 RegisterClangPass(PassManagerBuilder::EP_ModuleOptimizerEarly, registerLQICMPass);
 
+// With profile data, the trip count estimated from the weights of the exit/*{-{*/
+// branch. getLoopEstimatedTripCount reads the latch, the loops LQICM analyzes
+// exit in their header and their latch is unconditional.
+static Optional<unsigned> getEstimatedTripCount(Loop *L){
+  BasicBlock *Exiting = L->getExitingBlock();
+  if(!Exiting)
+    return None;
+  BranchInst *BI = dyn_cast<BranchInst>(Exiting->getTerminator());
+  uint64_t TrueWeight, FalseWeight;
+  if(!BI || !BI->isConditional() ||
+     !BI->extractProfMetadata(TrueWeight, FalseWeight))
+    return None;
+  bool ExitOnTrue = !L->contains(BI->getSuccessor(0));
+  uint64_t ExitWeight = ExitOnTrue ? TrueWeight : FalseWeight;
+  uint64_t StayWeight = ExitOnTrue ? FalseWeight : TrueWeight;
+  if(!ExitWeight)
+    return None;
+  // The body runs once per stay, a latch exit runs it once more
+  uint64_t TripCount = (StayWeight + ExitWeight / 2) / ExitWeight;
+  if(Exiting == L->getLoopLatch())
+    TripCount++;
+  return (unsigned)std::min<uint64_t>(TripCount, ~0u);
+}/*}-}*/
+
+// Expected trip count of the loop: the constant one computed by SCEV or, with/*{-{*/
+// profile data, the one estimated from the exit branch weights. 0 if unknown
+static unsigned getExpectedTripCount(Loop *L, ScalarEvolution *SE){
+  if(unsigned TripCount = SE->getSmallConstantTripCount(L))
+    return TripCount;
+  if(Optional<unsigned> EstTripCount = getEstimatedTripCount(L))
+    return *EstTripCount;
+  return 0;
+}/*}-}*/
+
+// With profile data, a loop whose header runs less than -lqicm-cold-loop-count/*{-{*/
+// times is not worth the analysis
+static bool isColdLoop(Loop *L, BlockFrequencyInfo *BFI){
+  if(!BFI || !L->getHeader()->getParent()->getEntryCount())
+    return false;
+  Optional<uint64_t> Count = BFI->getBlockProfileCount(L->getHeader());
+  return Count && *Count < ColdLoopCount;
+}/*}-}*/
+
+// Peeling cost model: the cloned code has to fit in the budget and the work/*{-{*/
+// saved on the remaining iterations has to pay for it
+static bool isProfitableToPeel(Loop *L, const PeelCost &PC, ScalarEvolution *SE,
+                               OptimizationRemarkEmitter *ORE){
+  Function *F = L->getHeader()->getParent();
+  unsigned Budget = PeelBudget;
+  if(F->optForMinSize())
+    Budget = 0;
+  else if(F->optForSize())
+    Budget = std::min(Budget, (unsigned)PeelOptSizeBudget);
+
+  if(PC.ClonedSize > Budget){
+    NumPeelOverBudget++;
+    ORE->emit(OptimizationRemarkMissed(DEBUG_TYPE, "PeelOverBudget",
+                                       L->getStartLoc(), L->getHeader())
+              << "not peeled: " << ore::NV("ClonedSize", PC.ClonedSize)
+              << " cloned is over the budget of " << ore::NV("Budget", Budget));
+    return false;
+  }
+
+  // Peeling pays only if most of the iterations run the lighter body
+  unsigned TripCount = getExpectedTripCount(L, SE);
+  if(TripCount && TripCount < (uint64_t)PC.PeelCount * PeelTripCountFactor){
+    NumPeelShortTripCount++;
+    ORE->emit(OptimizationRemarkMissed(DEBUG_TYPE, "PeelShortTripCount",
+                                       L->getStartLoc(), L->getHeader())
+              << "not peeled: expected trip count "
+              << ore::NV("TripCount", TripCount) << " is too close to the "
+              << ore::NV("PeelCount", PC.PeelCount) << " peeled iterations");
+    return false;
+  }
+  if(F->getEntryCount())
+    NumHotLoopsAccepted++;
+
+  // No iteration left when all of them are peeled, even with a factor of 0
+  unsigned Remaining = PeelUnknownTripCount;
+  if(TripCount)
+    Remaining = TripCount > PC.PeelCount ? TripCount - PC.PeelCount : 0;
+  if((uint64_t)PC.Saved * Remaining < PC.ClonedSize){
+    NumPeelUnprofitable++;
+    ORE->emit(OptimizationRemarkMissed(DEBUG_TYPE, "PeelUnprofitable",
+                                       L->getStartLoc(), L->getHeader())
+              << "not peeled: saves " << ore::NV("Saved", PC.Saved)
+              << " per iteration on " << ore::NV("Remaining", Remaining)
+              << " iterations for " << ore::NV("ClonedSize", PC.ClonedSize)
+              << " cloned");
+    return false;
+  }
+
+  ORE->emit(OptimizationRemarkAnalysis(DEBUG_TYPE, "PeelProfitable",
+                                       L->getStartLoc(), L->getHeader())
+            << "peeling " << ore::NV("PeelCount", PC.PeelCount)
+            << " iterations saves " << ore::NV("Saved", PC.Saved)
+            << " per iteration for " << ore::NV("ClonedSize", PC.ClonedSize)
+            << " cloned");
+  return true;
+}/*}-}*/
+
 int getDegMax(MapDeg *MD){/*{-{*/
   int degMax = -1;
   for(auto DD = MD->begin(), DDE = MD->end(); DD != DDE; ++DD){
@@ -1191,13 +1503,168 @@ int getDegMax(MapDeg *MD){/*{-{*/
   return degMax;
 }/*}-}*/
 
+// Write S as a JSON string/*{-{*/
+static void writeJSONString(raw_ostream &OS, StringRef S){
+  OS << '"';
+  for(unsigned char C : S){
+    if(C == '"' || C == '\\')
+      OS << '\\' << C;
+    else if(C < 0x20)
+      OS << format("\\u%04x", C);
+    else
+      OS << C;
+  }
+  OS << '"';
+}/*}-}*/
+
+// The stream of -lqicm-report, opened at the first record. It's unbuffered:
+// a record is one write on the O_APPEND descriptor, the records of
+// compilers sharing the file don't interleave./*{-{*/
+static raw_ostream *getReportStream(){
+  static std::unique_ptr<raw_fd_ostream> OS = []{
+    std::error_code EC;
+    auto Stream = make_unique<raw_fd_ostream>(ReportFile, EC,
+                                              sys::fs::F_Append |
+                                              sys::fs::F_Text);
+    if(EC){
+      errs() << "lqicm: can't open the report " << ReportFile << ": "
+             << EC.message() << "\n";
+      return std::unique_ptr<raw_fd_ostream>();
+    }
+    Stream->SetUnbuffered();
+    return Stream;
+  }();
+  return OS.get();
+}/*}-}*/
+
+/// The JSON record of a loop for -lqicm-report, written on one line when
+/// runOnLoop is over. The records go to the file one by one, nothing is kept
+/// for the whole module./*{-{*/
+struct LoopRecord {
+  struct Command {
+    const char* Kind;
+    std::string Name;
+    unsigned Line;
+    int Degree;
+  };
+
+  bool Enabled;
+  TimeRecord Start;
+  std::string Function, Header, Loc;
+  unsigned Depth = 0;
+  const char* Outcome = "not-analyzed";
+  std::string Reason;
+  bool Anchor = false;
+  int MaxDegree = -1;
+  unsigned NumVariables = 0, NumArrows = 0, NumQuasiInvariants = 0;
+  unsigned HoistableInsts = 0;
+  std::vector<Command> Commands;
+  const char* Peel = nullptr;
+  unsigned PeelCount = 0;
+
+  LoopRecord(Loop* L) : Enabled(!ReportFile.empty()) {
+    if(!Enabled)
+      return;
+    Start = TimeRecord::getCurrentTime(true);
+    Function = L->getHeader()->getParent()->getName().str();
+    Header = L->getHeader()->getName().str();
+    Depth = L->getLoopDepth();
+    if(DebugLoc DL = L->getStartLoc()){
+      raw_string_ostream OS(Loc);
+      OS << DL->getFilename() << ":" << DL.getLine() << ":" << DL.getCol();
+    }
+  }
+
+  void addCommand(Value* V, StringRef Name, int Degree){
+    if(!Enabled)
+      return;
+    const char* Kind = isa<BasicBlock>(V) ? "loop"
+      : isa<TerminatorInst>(V) ? "fork" : "inst";
+    Instruction* I = dyn_cast<Instruction>(V);
+    if(BasicBlock* BB = dyn_cast<BasicBlock>(V))
+      I = BB->getTerminator();
+    unsigned Line = I && I->getDebugLoc() ? I->getDebugLoc().getLine() : 0;
+    Commands.push_back({Kind, Name.str(), Line, Degree});
+    NumQuasiInvariants += Degree > 0;
+  }
+
+  ~LoopRecord(){
+    raw_ostream *OS = Enabled ? getReportStream() : nullptr;
+    if(!OS)
+      return;
+    TimeRecord Elapsed = TimeRecord::getCurrentTime(false);
+    Elapsed -= Start;
+
+    std::string Record;
+    raw_string_ostream RS(Record);
+    RS << "{\"function\":";
+    writeJSONString(RS, Function);
+    RS << ",\"header\":";
+    writeJSONString(RS, Header);
+    RS << ",\"loc\":";
+    writeJSONString(RS, Loc);
+    RS << ",\"depth\":" << Depth << ",\"outcome\":\"" << Outcome << "\"";
+    if(!Reason.empty()){
+      RS << ",\"reason\":";
+      writeJSONString(RS, Reason);
+    }
+    RS << ",\"anchor\":" << (Anchor ? "true" : "false")
+       << ",\"max_degree\":" << MaxDegree
+       << ",\"variables\":" << NumVariables << ",\"arrows\":" << NumArrows
+       << ",\"num_commands\":" << Commands.size()
+       << ",\"num_quasi_invariants\":" << NumQuasiInvariants
+       << ",\"hoistable_insts\":" << HoistableInsts
+       << ",\"time_s\":" << format("%.6f", Elapsed.getWallTime());
+    if(Peel)
+      RS << ",\"peel\":\"" << Peel << "\",\"peel_count\":" << PeelCount;
+    // Last the objects, the merge reads the fields before them
+    StringMap<double> &Phases = getAnalysisState().PhaseTimes;
+    if(!Phases.empty()){
+      // Sorted, the records of two runs can be compared
+      std::vector<StringRef> Names;
+      for(auto &P : Phases)
+        Names.push_back(P.getKey());
+      std::sort(Names.begin(), Names.end());
+      RS << ",\"phases\":{";
+      for(unsigned i = 0; i < Names.size(); ++i)
+        RS << (i ? "," : "") << "\"" << Names[i] << "\":"
+           << format("%.6f", Phases[Names[i]]);
+      RS << "}";
+    }
+    RS << ",\"commands\":[";
+    for(unsigned i = 0; i < Commands.size(); ++i){
+      Command &C = Commands[i];
+      RS << (i ? "," : "") << "{\"kind\":\"" << C.Kind << "\",\"name\":";
+      writeJSONString(RS, C.Name);
+      RS << ",\"line\":" << C.Line << ",\"degree\":" << C.Degree << "}";
+    }
+    RS << "]}\n";
+
+    // The whole record in a single write
+    StringRef Line = RS.str();
+    static std::mutex ReportLock;
+    std::lock_guard<std::mutex> Lock(ReportLock);
+    OS->write(Line.data(), Line.size());
+  }
+};/*}-}*/
+
 ///
 bool LoopInvariantCodeMotion::runOnLoop(Loop *L, AliasAnalysis *AA,/*{-{*/
                                         LoopInfo *LI, DominatorTree *DT,
                                         DependenceInfo *DI,
                                         PostDominatorTree *PDT,
-                                        ScalarEvolution *SE, bool DeleteAST) {
+                                        RegionInfo *RI,
+                                        function_ref<void()> UpdateRegions,
+                                        ScalarEvolution *SE,
+                                        const TargetTransformInfo *TTI,
+                                        BlockFrequencyInfo *BFI,
+                                        OptimizationRemarkEmitter *ORE,
+                                        bool DeleteAST) {
   bool Changed = false;
+  // The relation engine works on the state of this instance
+  AnalysisStateScope StateScope(State);
+  State.TimePhases = TimePhases;
+  LoopRecord Rec(L);
 
   assert(L->isLCSSAForm(*DT) && "Loop is not in LCSSA form.");
 
@@ -1206,6 +1673,29 @@ bool LoopInvariantCodeMotion::runOnLoop(Loop *L, AliasAnalysis *AA,/*{-{*/
     DEBUG(
         dbgs() << "  Not unrolling loop which is not in loop-simplify form.\n");
     NotSimplified++;
+    Rec.Outcome = "not-simplified";
+    ORE->emit(OptimizationRemarkMissed(DEBUG_TYPE, "NotSimplified",
+                                       L->getStartLoc(), L->getHeader())
+              << "loop not analyzed, not in loop-simplify form");
+    return false;
+  }
+
+  // Don't spend time on loops the profile says are cold
+  if(isColdLoop(L, BFI)){
+    DEBUG(dbgs() << "  Skipping cold loop " << L->getHeader()->getName()
+          << ".\n");
+    NumColdLoopsSkipped++;
+    Rec.Outcome = "cold";
+    Rec.Anchor = true;
+    // The parent loops see an anchor, as for a loop over budget
+    Chunk* ColdChunk = new Chunk(L->getHeader()->getName());
+    ColdChunk->setStart(L->getHeader());
+    ColdChunk->setRel(getOpaqueLoopRelation(L));
+    ColdChunk->setAnchor(true);
+    mapChunk[L->getHeader()] = ColdChunk;
+    ORE->emit(OptimizationRemarkMissed(DEBUG_TYPE, "ColdLoop",
+                                       L->getStartLoc(), L->getHeader())
+              << "cold loop not analyzed");
     return false;
   }
 
@@ -1226,7 +1716,11 @@ bool LoopInvariantCodeMotion::runOnLoop(Loop *L, AliasAnalysis *AA,/*{-{*/
   // TODO Here we can try to compute the trip count of the loop. Is it usefull
   // for us?
 
-  AliasSetTracker *CurAST = collectAliasInfoForLoop(L, LI, AA);
+  AliasSetTracker *CurAST;
+  {
+    PhaseTimer T("alias", "Alias sets", L);
+    CurAST = collectAliasInfoForLoop(L, LI, AA);
+  }
 
   // Get the preheader block to move instructions into...
   BasicBlock *Preheader = L->getLoopPreheader();
@@ -1303,6 +1797,7 @@ bool LoopInvariantCodeMotion::runOnLoop(Loop *L, AliasAnalysis *AA,/*{-{*/
       }
 
       if(!isOk){
+        Rec.Outcome = "exit-in-parent";
         if (L->getParentLoop() && !DeleteAST)
           LoopToAliasSetMap[L] = CurAST;
         else
@@ -1339,14 +1834,60 @@ bool LoopInvariantCodeMotion::runOnLoop(Loop *L, AliasAnalysis *AA,/*{-{*/
       // Ordered Commands
       std::vector<Value*> OC;
 
+      LoopBudget &Budget = State.Budget;
+      AnalysisAbort &Abort = State.Abort;
+      Budget.MaxInsts = MaxLoopInsts;
+      Budget.MaxVariables = MaxRelationVariables;
+      Budget.MaxArrows = MaxRelationArrows;
+      Budget.MaxFixPointRounds = MaxFixPointRounds;
+      Budget.MaxDepSteps = MaxDepSteps;
+      Budget.reset();
+      Abort.reset();
+      // The inner loops are already summed up by their relation
+      unsigned NumInsts = 0;
+      for(BasicBlock* BB : L->blocks())
+        if(LI->getLoopFor(BB) == L)
+          NumInsts += BB->size();
+
       // Computes the Relation of the loop by recursively computing inner
       // relations (each subLoops, branches, instructions…)
-      Relation *RL = computeRelationLoop(DT->getNode(L->getHeader()), &mapChunk,
-                                         AA, LI, DT, L, CurAST, &SafetyInfo, DI,
-                                         PDT, &OC);
+      Relation *RL = nullptr;
+      if(Budget.check(NumInsts, Budget.MaxInsts, "instructions")){
+        // PDT and RI follow the loops changed before this one
+        UpdateRegions();
+        RL = computeRelationLoop(DT->getNode(L->getHeader()), &mapChunk, AA,
+                                 LI, DT, L, CurAST, &SafetyInfo, DI, PDT, RI,
+                                 &OC);
+      }
+      // Given up: the parent loops see an anchor
+      if(Budget.Exceeded){
+        NumLoopsOverBudget++;
+        Rec.Outcome = "over-budget";
+        Rec.Reason = Budget.Exceeded;
+        Rec.Anchor = true;
+        loopChunk->setRel(getOpaqueLoopRelation(L));
+        loopChunk->setAnchor(true);
+        ORE->emit(OptimizationRemarkMissed(DEBUG_TYPE, "OverBudget",
+                                           L->getStartLoc(), L->getHeader())
+                  << "loop not analyzed, too many "
+                  << getRemarkString("Limit", Budget.Exceeded));
+        if (L->getParentLoop() && !DeleteAST)
+          LoopToAliasSetMap[L] = CurAST;
+        else
+          delete CurAST;
+        return false;
+      }
       if(!RL){
         DEBUG(errs() <<"ERROR computation Relation of Loop\n");
         NumError++;
+        Rec.Outcome = "failed";
+        Rec.Reason = Abort.Reason ? Abort.Reason : "";
+        ORE->emit(OptimizationRemarkMissed(DEBUG_TYPE, "AnalysisFailed",
+                                           getRemarkLoc(Abort.At, L),
+                                           L->getHeader())
+                  << "loop not analyzed, "
+                  << getRemarkString("Reason", Abort.Reason ? Abort.Reason
+                                     : "relation of the loop not computed"));
         loopChunk->setType(Chunk::ERROR);
         if (L->getParentLoop() && !DeleteAST)
           LoopToAliasSetMap[L] = CurAST;
@@ -1356,14 +1897,80 @@ bool LoopInvariantCodeMotion::runOnLoop(Loop *L, AliasAnalysis *AA,/*{-{*/
       }
       NumOK++;
       loopChunk->setRel(RL);
+      Rec.Outcome = "ok";
+      Rec.Anchor = loopChunk->isAnchor();
+      Rec.NumVariables = RL->getNumVariables();
+      Rec.NumArrows = RL->getNumArrows();
       /* DEBUG(RL->dump(dbgs())); */
+      computeDegreeVectors(L, &mapChunk, LI, &DegreeVectors);
+      // Written before any transform, the clones keep them
+      if(EnableDegreeMetadata)
+        NumDegreeMetadata += annotateDegrees(L, loopChunk->getMapDeg(), LI);
 
       //Here we transform the current loop!
       // - Need the max deg if deg max is -1 do nothing and return false
       int maxDeg = getDegMax(loopChunk->getMapDeg());
       DEBUG(dbgs() <<"*********************maxDeg******************\n");
       DEBUG(dbgs() << maxDeg <<"\n");
-      if(maxDeg!=-1 && !hasExitInParent){
+      {
+        // The inner loops, the forks and the quasi-invariant instructions
+        MapDeg* mapDeg = loopChunk->getMapDeg();
+        SmallVector<std::pair<Value*, int>, 16> Commands;
+        std::vector<std::string> Names;
+        ModuleSlotTracker MST(L->getHeader()->getModule());
+        unsigned NumHoistable = 0;
+        for(Value* V : OC){
+          auto DD = mapDeg->find(V);
+          if(DD == mapDeg->end())
+            continue;
+          std::string Name = getCommandName(V, MST);
+          Rec.addCommand(V, Name, DD->second);
+          bool IsChunk = isa<BasicBlock>(V) ||
+            (isa<TerminatorInst>(V) && mapChunk.count(V));
+          if(!IsChunk && DD->second == -1)
+            continue;
+          if(DD->second > 0)
+            NumHoistable += getNumCommandInsts(V, &mapChunk, LI);
+          Commands.push_back(*DD);
+          Names.push_back(std::move(Name));
+        }
+        Rec.MaxDegree = maxDeg;
+        Rec.HoistableInsts = NumHoistable;
+        OptimizationRemarkAnalysis RA(DEBUG_TYPE, "Degrees", L->getStartLoc(),
+                                      L->getHeader());
+        RA << "max degree " << ore::NV("MaxDegree", maxDeg) << ", "
+           << ore::NV("HoistableInsts", NumHoistable)
+           << " hoistable instructions in "
+           << ore::NV("NumCommands", (unsigned)Commands.size()) << " commands:";
+        for(unsigned i = 0; i < Commands.size(); ++i)
+          RA << " " << getRemarkCommand(Commands[i].first, Names[i], L, LI)
+             << "=" << ore::NV("Degree", Commands[i].second);
+        ORE->emit(RA);
+      }
+      if(maxDeg!=-1 && !hasExitInParent && EnablePeelMetadata){
+        // Analysis only: the upstream peeling does the job once the loop is
+        // rotated. The removable commands are out of the header, the rotated
+        // loop runs them in the same iteration: the count does not change.
+        unsigned PeelCount = getPeelCount(L, &mapChunk, &OC, DT, LI);
+        DEBUG(dbgs() << "PeelCount = " << PeelCount << "\n");
+        Rec.PeelCount = PeelCount;
+        Rec.Peel = "none";
+        if(PeelCount > 0 && !canPeel(L))
+          DEBUG(dbgs() << "The upstream peeling can't peel a loop with "
+                "several exits\n");
+        else if(PeelCount > 0 && PeelCount <= PeelMaxCount){
+          Rec.Peel = "metadata";
+          setRotatedPeelCount(L, PeelCount);
+          NumPeelCountMetadata++;
+          Changed = true;
+          ORE->emit(OptimizationRemarkAnalysis(DEBUG_TYPE, "PeelCountMetadata",
+                                               L->getStartLoc(),
+                                               L->getHeader())
+                    << "peeling " << ore::NV("PeelCount", PeelCount)
+                    << " iterations makes the quasi-invariant chunks "
+                    << "invariant");
+        }
+      } else if(maxDeg!=-1 && !hasExitInParent){
         DEBUG(dbgs() <<"Something has to be peeled…\n");
         // - For each deg d from 0 to degMax:
         //    - Create a CFG with all commands in the loop with deg rather than d
@@ -1371,18 +1978,157 @@ bool LoopInvariantCodeMotion::runOnLoop(Loop *L, AliasAnalysis *AA,/*{-{*/
         //    - Put this CFG in a kind of "preheader" of degree d with the same
         //    stop condition as for the loop
         // - Remove all command with a deg not equal to -1
-        /* Changed = mypeelLoop(L, maxDeg, &mapChunk, &OC, LI, SE, DT, PDT, true); */
+        // Invariant inner loops and forks are moved before the loop first,
+        // no need to peel for them
+        if(EnableChunkHoist && SE){
+          unsigned NumHoisted = hoistInvariantChunks(L, &mapChunk, &OC, LI, SE,
+                                                     DT);
+          if(NumHoisted){
+            Changed = true;
+            ORE->emit(OptimizationRemark(DEBUG_TYPE, "ChunksHoisted",
+                                         L->getStartLoc(), L->getHeader())
+                      << "hoisted " << ore::NV("NumChunks", NumHoisted)
+                      << " invariant chunks without peeling");
+          }
+        }
+        if(EnableNestHoist && SE){
+          unsigned NumLevels = hoistAcrossNest(L, &mapChunk, &DegreeVectors,
+                                               LI, SE, DT);
+          if(NumLevels){
+            Changed = true;
+            ORE->emit(OptimizationRemark(DEBUG_TYPE, "NestHoisted",
+                                         L->getStartLoc(), L->getHeader())
+                      << "hoisted invariant chunks of the loop nest out of "
+                      << ore::NV("NumLevels", NumLevels) << " loop levels");
+          }
+        }
+        // Only the commands removable from the body drive the peel count
+        unsigned PeelCount = getPeelCount(L, &mapChunk, &OC, DT, LI);
+        DEBUG(dbgs() << "PeelCount = " << PeelCount << "\n");
+        // A split clones the body once, it is better for high degrees
+        bool Split = EnableSplit && (PeelCount > 1 || !EnablePeel);
+        if(EnablePeel || EnableSplit){
+          Rec.PeelCount = PeelCount;
+          Rec.Peel = "none";
+        }
+        if((EnablePeel || EnableSplit) && SE && TTI && PeelCount > 0 &&
+           (Split || PeelCount <= PeelMaxCount)){
+          Rec.Peel = "rejected";
+          PeelCost PC = computePeelCost(L, PeelCount, &mapChunk, &OC, DT, LI,
+                                        SE, TTI, PeelUnknownTripCount);
+          if(Split)
+            PC.ClonedSize = PC.BodySize;
+          // Only the computation of the chunks is peeled when possible
+          SmallSetVector<Instruction*, 16> PeelSlice;
+          SmallVector<Instruction*, 8> SliceCommands;
+          bool Slice = !Split && EnableSlicePeel &&
+            collectPeelSlice(L, PeelCount, &mapChunk, &OC, DT, LI, PeelSlice,
+                             SliceCommands);
+          if(Slice)
+            PC.ClonedSize = getSliceCost(PeelSlice, TTI) * PeelCount;
+          // A short loop runs the original version, not the peeled one: the
+          // original loop is cloned too
+          const SCEV *BTC = SE->getBackedgeTakenCount(L);
+          bool Version = !Split && !Slice && EnableVersioning &&
+            canVersionOnTripCount(L, SE) &&
+            !SE->isKnownPredicate(ICmpInst::ICMP_UGE, BTC,
+                                  SE->getConstant(BTC->getType(), PeelCount));
+          if(Version)
+            PC.ClonedSize += PC.BodySize;
+          if(isProfitableToPeel(L, PC, SE, ORE)){
+            // The remark is built before the loop changes
+            OptimizationRemark R(DEBUG_TYPE, Split ? "Split"
+                                 : Slice ? "SlicePeeled" : "Peeled",
+                                 L->getStartLoc(), L->getHeader());
+            // mypeelLoop only fails on the loops canPeel rejects, a versioned
+            // loop is still simplified with a single exit: the peel follows
+            Loop *SlowLoop = nullptr;
+            if(Version){
+              SlowLoop = versionLoopOnTripCount(L, PeelCount, LI, DT, SE,
+                                                true);
+              assert(SlowLoop && canPeel(L) && "Versioning failed");
+              Changed = true;
+            }
+            SmallPtrSet<BasicBlock*, 32> OldBlocks;
+            for(BasicBlock &BB : *L->getHeader()->getParent())
+              OldBlocks.insert(&BB);
+            bool Peeled;
+            {
+              PhaseTimer T("peel", "Peeling", L);
+              Peeled =
+                Split ? splitLoop(L, PeelCount, &mapChunk, &OC, LI, SE, DT, true)
+                : Slice ? slicePeelLoop(L, PeelCount, PeelSlice, SliceCommands,
+                                        &mapChunk, LI, SE, DT)
+                        : mypeelLoop(L, PeelCount, &mapChunk, &OC, LI, SE, DT,
+                                     true);
+            }
+            Changed |= Peeled;
+            Rec.Peel = !Peeled ? "failed" : Split ? "split"
+              : Slice ? "sliced" : "peeled";
+            if(Peeled)
+              ORE->emit(R << (Split ? "split after "
+                              : Slice ? "peeled the slice of the chunks for "
+                              : "peeled ")
+                        << ore::NV("PeelCount", PeelCount)
+                        << " iterations to hoist "
+                        << ore::NV("NumChunks", PC.NumChunks)
+                        << " quasi-invariant chunks");
+            // Don't wait for a later licm run to shrink the body
+            if(Peeled && EnablePostPeelHoist){
+              Function &F = *L->getHeader()->getParent();
+              NumPeelSimplified += simplifyPeeledBlocks(F, OldBlocks, DT);
+              NumPostPeelHoisted += hoistAfterPeel(L, AA, LI, DT);
+            }
+            // The slow path runs at most PeelCount iterations, the vectorizer
+            // keeps its cost model for the fast path
+            if(SlowLoop)
+              addStringMetadataToLoop(SlowLoop, "llvm.loop.vectorize.width",
+                                      1);
+            // The forks stable after the peeled iterations leave the body
+            if(Peeled && EnableUnswitch){
+              unsigned NumUnswitched =
+                unswitchQuasiInvariantForks(L, PeelCount, &mapChunk, LI, DT,
+                                            SE, TTI, UnswitchMaxCount,
+                                            UnswitchThreshold, true);
+              if(NumUnswitched)
+                ORE->emit(OptimizationRemark(DEBUG_TYPE, "Unswitched",
+                                             L->getStartLoc(), L->getHeader())
+                          << "unswitched "
+                          << ore::NV("NumForks", NumUnswitched)
+                          << " quasi-invariant forks");
+            }
+          }
+        }
         if(Changed)
           DEBUG(dbgs() <<"PEELED!\n");
         else DEBUG(dbgs() <<"IMPOSSIBLE TO PEEL!\n");
       } else{
         loopChunk->setPeeled(true);
       }
+      // The chunks still variant may be skipped when their inputs are stable
+      if(EnableMemoize && !EnablePeelMetadata && !hasExitInParent && SE &&
+         TTI){
+        unsigned NumMemoized = memoizeChunks(L, &mapChunk, &OC, LI, DT, SE,
+                                             TTI, MemoizeMinCost,
+                                             MemoizeMaxInputs);
+        if(NumMemoized){
+          Changed = true;
+          ORE->emit(OptimizationRemark(DEBUG_TYPE, "ChunksMemoized",
+                                       L->getStartLoc(), L->getHeader())
+                    << "memoized " << ore::NV("NumChunks", NumMemoized)
+                    << " variant chunks on their inputs");
+        }
+      }
     }
   } else {
     NoPreHeader++;
+    Rec.Outcome = "no-preheader";
+    ORE->emit(OptimizationRemarkMissed(DEBUG_TYPE, "NoPreheader",
+                                       L->getStartLoc(), L->getHeader())
+              << "loop not analyzed, no preheader");
   }
-  if (L->getParentLoop() && !DeleteAST)
+  // Once peeled the alias sets are stale, the parent loop will recompute them
+  if (L->getParentLoop() && !DeleteAST && !Changed)
     LoopToAliasSetMap[L] = CurAST;
   else
     delete CurAST;
@@ -1594,6 +2340,92 @@ static bool isSafeToExecuteUnconditionally(const Instruction &Inst,/*{-{*/
   return isGuaranteedToExecute(Inst, DT, CurLoop, SafetyInfo);
 }/*}-}*/
 
+// Simplify the instructions of the blocks created by a peeling (those not in/*{-{*/
+// Old), the first iterations often fold. Return the number of instructions
+// simplified.
+static unsigned simplifyPeeledBlocks(Function &F,
+                                     const SmallPtrSetImpl<BasicBlock*> &Old,
+                                     DominatorTree* DT){
+  const DataLayout &DL = F.getParent()->getDataLayout();
+  unsigned NumSimplified = 0;
+  SmallVector<WeakVH, 16> DeadInsts;
+  for(BasicBlock &BB : F){
+    if(Old.count(&BB))
+      continue;
+    for(Instruction &I : BB){
+      if(!I.use_empty())
+        if(Value *V = SimplifyInstruction(&I, DL, nullptr, DT)){
+          DEBUG(dbgs() << "LQICM simplifying peeled: " << I << "\n");
+          I.replaceAllUsesWith(V);
+          NumSimplified++;
+        }
+      if(isInstructionTriviallyDead(&I))
+        DeadInsts.push_back(&I);
+    }
+  }
+  // Deleted once the blocks are walked, an operand may go with them
+  for(WeakVH &V : DeadInsts)
+    if(Instruction *I = dyn_cast_or_null<Instruction>(V))
+      RecursivelyDeleteTriviallyDeadInstructions(I);
+  return NumSimplified;
+}/*}-}*/
+
+// LICM on the body left by a peeling: sink what is only used after the/*{-{*/
+// loop, then hoist what became invariant, in dominance order so that chains
+// move together. Return the number of instructions moved.
+static unsigned hoistAfterPeel(Loop* L, AliasAnalysis* AA, LoopInfo* LI,
+                               DominatorTree* DT){
+  BasicBlock *Preheader = L->getLoopPreheader();
+  if(!Preheader)
+    return 0;
+  // The alias sets and the safety info of the peeled loop are stale
+  AliasSetTracker AST(*AA);
+  for(BasicBlock *BB : L->blocks())
+    AST.add(*BB);
+  LoopSafetyInfo SafetyInfo;
+  computeLoopSafetyInfo(&SafetyInfo, L);
+
+  LoopBlocksDFS DFS(L);
+  DFS.perform(LI);
+  unsigned NumMoved = 0;
+  // sink() needs the exit phis of LCSSA
+  if(L->isLCSSAForm(*DT))
+    for(auto BI = DFS.beginPostorder(), BE = DFS.endPostorder(); BI != BE;
+        ++BI){
+      BasicBlock *BB = *BI;
+      if(LI->getLoopFor(BB) != L)
+        continue;
+      for(BasicBlock::iterator II = BB->end(); II != BB->begin();){
+        Instruction &I = *--II;
+        if(isa<PHINode>(I) || I.use_empty() ||
+           !isNotUsedInLoop(I, L, &SafetyInfo) ||
+           !myCanSinkOrHoistInst(I, AA, DT, L, &AST, &SafetyInfo))
+          continue;
+        ++II;
+        sink(I, LI, DT, L, &AST, &SafetyInfo);
+        NumMoved++;
+      }
+    }
+
+  Instruction *InsertPt = Preheader->getTerminator();
+  for(auto BI = DFS.beginRPO(), BE = DFS.endRPO(); BI != BE; ++BI){
+    BasicBlock *BB = *BI;
+    if(LI->getLoopFor(BB) != L)
+      continue;
+    for(BasicBlock::iterator II = BB->begin(), E = BB->end(); II != E;){
+      Instruction &I = *II++;
+      if(!L->hasLoopInvariantOperands(&I) ||
+         !myCanSinkOrHoistInst(I, AA, DT, L, &AST, &SafetyInfo) ||
+         !isSafeToExecuteUnconditionally(I, DT, L, &SafetyInfo, InsertPt))
+        continue;
+      DEBUG(dbgs() << "LQICM hoisting after peel: " << I << "\n");
+      I.moveBefore(InsertPt);
+      NumMoved++;
+    }
+  }
+  return NumMoved;
+}/*}-}*/
+
 /// Returns an owning pointer to an alias set which incorporates aliasing info
 /// from L and all subloops of L.
 /// FIXME: In new pass manager, there is no helper function to handle loop
@@ -1641,8 +2473,10 @@ LoopInvariantCodeMotion::collectAliasInfoForLoop(Loop *L, LoopInfo *LI,/*{-{*/
   };
 
   // Add everything from the sub loops that are no longer directly available.
+  // Their own sub loops are not available either.
   for (Loop *InnerL : RecomputeLoops)
-    mergeLoop(InnerL);
+    for (BasicBlock *BB : InnerL->blocks())
+      CurAST->add(*BB);
 
   // And merge in this loop.
   mergeLoop(L);
@@ -1,13 +1,70 @@
 #ifndef LLVM_TRANSFORMS_SCALAR_LQICM_H
 #define LLVM_TRANSFORMS_SCALAR_LQICM_H
 
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Metadata.h"
 #include "llvm/Transforms/Scalar/LoopPassManager.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/IR/PassManager.h"
 
 namespace llvm {
 
+/// Metadata written by -lqicm-degree-metadata: !lqicm.degree !{i32 D} on the
+/// instructions and terminators of forks, llvm.loop.lqicm.degree in the loop
+/// ID of inner loops. D is the degree in the loop holding the command, -1 if
+/// it is not invariant. The metadata follows the instructions when cloned.
+static const char *const DegreeMDKind = "lqicm.degree";
+static const char *const LoopDegreeMDName = "llvm.loop.lqicm.degree";
+
+// Degree of I computed by LQICM, None if it was not analyzed
+inline Optional<int> getLQICMDegree(const Instruction &I) {
+  MDNode *MD = I.getMetadata(DegreeMDKind);
+  if (!MD || MD->getNumOperands() != 1)
+    return None;
+  if (ConstantInt *CI = mdconst::dyn_extract<ConstantInt>(MD->getOperand(0)))
+    return (int)CI->getSExtValue();
+  return None;
+}
+
+// Degree of the inner loop L in its parent computed by LQICM, None if it was
+// not analyzed
+inline Optional<int> getLQICMLoopDegree(const Loop &L) {
+  MDNode *LoopID = L.getLoopID();
+  if (!LoopID)
+    return None;
+  for (unsigned i = 1, e = LoopID->getNumOperands(); i < e; ++i) {
+    MDNode *MD = dyn_cast<MDNode>(LoopID->getOperand(i));
+    if (!MD || MD->getNumOperands() != 2)
+      continue;
+    MDString *Name = dyn_cast<MDString>(MD->getOperand(0));
+    if (!Name || Name->getString() != LoopDegreeMDName)
+      continue;
+    if (ConstantInt *CI = mdconst::dyn_extract<ConstantInt>(MD->getOperand(1)))
+      return (int)CI->getSExtValue();
+  }
+  return None;
+}
+
+class Pass;
+namespace legacy {
+class PassManagerBase;
+}
+
+/// The legacy LQICM loop pass.
+Pass *createLQICMPass();
+
+/// Add LQICM to PM with the passes it expects before: mem2reg, indvars,
+/// simplifycfg and its analyses.
+void addLQICMPasses(legacy::PassManagerBase &PM);
+
+/// With -lqicm-time-phases, the wall seconds spent in each phase of LQICM
+/// (alias, phi, body, fixpoint, depchunks, degrees, peel) by the loops
+/// analyzed on this thread since the last call.
+StringMap<double> takeLQICMPhaseTimes();
+
 /// Performs Loop Invariant Code Motion Pass.
 class LQICMPass : public PassInfoMixin<LQICMPass> {
 public:
@@ -14,35 +14,55 @@
 /* // TargetTransformInfo::UnrollingPreferences */
 /* #include "llvm/Analysis/TargetTransformInfo.h" */
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SetVector.h"
 #include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/AliasSetTracker.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/ConstantFolding.h"
 #include "llvm/Analysis/DependenceAnalysis.h"
+#include "llvm/Analysis/DominanceFrontier.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/LoopPass.h"
 #include "llvm/Analysis/LoopUnrollAnalyzer.h"
+#include "llvm/Analysis/OptimizationDiagnosticInfo.h"
 #include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/RegionInfo.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/ModuleSlotTracker.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Timer.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Utils/LoopUtils.h"
 #include "llvm/Transforms/Scalar/LoopPassManager.h"
 
 #include "llvm/Analysis/LoopIterator.h"
 #include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
 #include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/ValueMap.h"
+#include "llvm/Pass.h"
+#include "llvm/IR/Verifier.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/UnrollLoop.h"
 #include <algorithm>
+#include <mutex>
 /* #include <utility> */
 
 using namespace llvm;
@@ -70,6 +90,59 @@ STATISTIC(InnerLoopNotAnalysed, "Number of with inner loop aborted…");
 STATISTIC(ForkWithTwoBreak, "Number of branch with 2 jumps oustide…");
 STATISTIC(BranchWithBreakUnexpected, "Number of branch with unexpected break");
 STATISTIC(WeirdTermination, "Number of weird termination");
+STATISTIC(NumRegionForks, "Number of forks closed by a SESE region");
+STATISTIC(NumSwitchForks, "Number of switch analyzed as a fork chunk");
+STATISTIC(NumPeeledLoops, "Number of loops peeled regarding to their degrees");
+STATISTIC(NumHoistedInsts, "Number of quasi-invariant instructions hoisted");
+STATISTIC(NumHoistedChunks, "Number of quasi-invariant chunks hoisted");
+STATISTIC(NumDirectHoists, "Number of invariant chunks hoisted without peeling");
+STATISTIC(NumNestHoists, "Number of invariant chunks hoisted across a loop nest");
+STATISTIC(NumDegreeMetadata, "Number of commands annotated with their degree");
+STATISTIC(NumPeelCountMetadata, "Number of loops annotated with a peel count");
+STATISTIC(NumAnnotatedPeeled, "Number of annotated loops peeled upstream");
+STATISTIC(NumPostPeelHoisted, "Number of instructions moved by LICM after a peeling");
+STATISTIC(NumPeelSimplified, "Number of instructions simplified in peeled blocks");
+STATISTIC(NumMemoizedChunks, "Number of variant pure chunks memoized");
+STATISTIC(NumSlicePeeled, "Number of loops peeled on the slice of their chunks");
+STATISTIC(NumSplitLoops, "Number of loops split in a prologue and a main loop");
+STATISTIC(NumVersionedLoops, "Number of loops versioned on their trip count");
+STATISTIC(NumUnswitchedForks, "Number of quasi-invariant forks unswitched");
+STATISTIC(NumPeelOverBudget, "Number of peelings aborted by the size budget");
+STATISTIC(NumPeelUnprofitable, "Number of peelings aborted by the cost model");
+STATISTIC(NumPeelShortTripCount, "Number of peelings aborted by a short trip count");
+STATISTIC(NumColdLoopsSkipped, "Number of cold loops skipped with profile data");
+STATISTIC(NumHotLoopsAccepted, "Number of loops with profile data long enough to peel");
+
+// Relation engine, the histograms have a counter per bucket
+STATISTIC(NumCompositions, "Number of compositions of relations");
+STATISTIC(CompositionDep4, "Compositions of relations with |dep| < 4");
+STATISTIC(CompositionDep16, "Compositions of relations with |dep| < 16");
+STATISTIC(CompositionDep64, "Compositions of relations with |dep| < 64");
+STATISTIC(CompositionDep256, "Compositions of relations with |dep| < 256");
+STATISTIC(CompositionDepMore, "Compositions of relations with |dep| >= 256");
+STATISTIC(FixPointIter2, "Fixpoints reached in less than 2 iterations");
+STATISTIC(FixPointIter4, "Fixpoints reached in less than 4 iterations");
+STATISTIC(FixPointIter8, "Fixpoints reached in less than 8 iterations");
+STATISTIC(FixPointIterMore, "Fixpoints reached in 8 iterations or more");
+STATISTIC(OCLength16, "Loops with less than 16 ordered commands");
+STATISTIC(OCLength64, "Loops with less than 64 ordered commands");
+STATISTIC(OCLength256, "Loops with less than 256 ordered commands");
+STATISTIC(OCLengthMore, "Loops with 256 ordered commands or more");
+STATISTIC(MaxVSetSize, "Maximum number of variables of a relation");
+STATISTIC(MaxDepForXDepth, "Maximum recursion depth of computeDepForX");
+STATISTIC(NumComputeDeg, "Number of calls to computeDeg");
+STATISTIC(NumLoopsOverBudget, "Number of loops whose analysis exceeded a budget");
+
+static Statistic* const CompositionDepHisto[] = {
+  &CompositionDep4, &CompositionDep16, &CompositionDep64, &CompositionDep256,
+  &CompositionDepMore
+};
+static Statistic* const FixPointIterHisto[] = {
+  &FixPointIter2, &FixPointIter4, &FixPointIter8, &FixPointIterMore
+};
+static Statistic* const OCLengthHisto[] = {
+  &OCLength16, &OCLength64, &OCLength256, &OCLengthMore
+};
 
 // Relation object TODO should be somewhere else…
 namespace llvm {
@@ -81,12 +154,12 @@ namespace llvm {
     TOTA, // (1,1)
   };
 
-  DepType Plus[4][4] = { {EMPT,PROP,STRO,TOTA},
+  constexpr DepType Plus[4][4] = { {EMPT,PROP,STRO,TOTA},
                       {PROP,PROP,TOTA,TOTA},
                       {STRO,TOTA,STRO,TOTA},
                       {TOTA,TOTA,TOTA,TOTA}
                     };
-  DepType Time[4][4] = { {EMPT,EMPT,EMPT,EMPT},
+  constexpr DepType Time[4][4] = { {EMPT,EMPT,EMPT,EMPT},
                       {EMPT,PROP,STRO,TOTA},
                       {EMPT,STRO,STRO,TOTA},
                       {EMPT,TOTA,TOTA,TOTA}
@@ -101,6 +174,223 @@ namespace llvm {
   typedef SmallPtrSet<BasicBlock*,8> BSet;
   typedef DenseMap<Value*, int> MapDeg;
 
+  /// Count N in the histogram H: the bucket i holds the values below
+  /// First * Base^i, the last bucket the others./*{-{*/
+  template <size_t Size>
+  static void addToHistogram(unsigned (&H)[Size], uint64_t N, uint64_t First,
+                             uint64_t Base){
+    unsigned i = 0;
+    for(uint64_t Bound = First; i + 1 < Size && N >= Bound; Bound *= Base)
+      ++i;
+    ++H[i];
+  }/*}-}*/
+
+  static void updateMax(unsigned &Max, unsigned N){
+    if(N > Max)
+      Max = N;
+  }
+
+  /// Counters of the relation engine. They are kept by each analysis and
+  /// merged in the statistics once a loop is done, the hot paths don't
+  /// touch the shared counters./*{-{*/
+  struct EngineCounters {
+    unsigned Compositions = 0;
+    unsigned CompositionDeps[5] = {};
+    unsigned FixPointRounds[4] = {};
+    unsigned OCLengths[4] = {};
+    unsigned VSetSize = 0;
+    unsigned DepForXDepth = 0;
+    unsigned ComputeDegCalls = 0;
+
+    void flush(){
+      NumCompositions += Compositions;
+      NumComputeDeg += ComputeDegCalls;
+      for(unsigned i = 0; i < array_lengthof(CompositionDeps); ++i)
+        *CompositionDepHisto[i] += CompositionDeps[i];
+      for(unsigned i = 0; i < array_lengthof(FixPointRounds); ++i)
+        *FixPointIterHisto[i] += FixPointRounds[i];
+      for(unsigned i = 0; i < array_lengthof(OCLengths); ++i)
+        *OCLengthHisto[i] += OCLengths[i];
+      {
+        // Read and written, the maximums need a lock
+        static std::mutex MaxLock;
+        std::lock_guard<std::mutex> Lock(MaxLock);
+        if(VSetSize > MaxVSetSize)
+          MaxVSetSize = VSetSize;
+        if(DepForXDepth > MaxDepForXDepth)
+          MaxDepForXDepth = DepForXDepth;
+      }
+      *this = EngineCounters();
+    }
+  };/*}-}*/
+
+  /// Limits of the work done on a single loop (0 for no limit). The relation
+  /// engine stops as soon as one of them is exceeded and the loop is then an
+  /// anchor./*{-{*/
+  struct LoopBudget {
+    unsigned MaxInsts = 0;
+    unsigned MaxVariables = 0;
+    unsigned MaxArrows = 0;
+    unsigned MaxFixPointRounds = 0;
+    unsigned MaxDepSteps = 0;
+    unsigned DepSteps = 0;
+    const char* Exceeded = nullptr; // The first limit exceeded
+
+    void reset(){
+      DepSteps = 0;
+      Exceeded = nullptr;
+    }
+    /// Check N against the limit Max, named What
+    bool check(unsigned N, unsigned Max, const char* What){
+      if(Max && N > Max && !Exceeded){
+        DEBUG(dbgs() << "Budget exceeded: " << N << " " << What << '\n');
+        Exceeded = What;
+      }
+      return !Exceeded;
+    }
+  };/*}-}*/
+
+
+  /// Why the analysis of a loop stopped and where, for the remarks./*{-{*/
+  struct AnalysisAbort {
+    const char* Reason = nullptr;
+    Value* At = nullptr;
+
+    void reset(){
+      Reason = nullptr;
+      At = nullptr;
+    }
+    /// Keep the first reason, the innermost
+    void set(const char* Why, Value* Where){
+      if(!Reason){
+        Reason = Why;
+        At = Where;
+      }
+    }
+  };/*}-}*/
+
+  /// What the analysis of a loop changes besides the chunks: its budget, why
+  /// it stopped, its counters and, with -lqicm-time-phases, the time of its
+  /// phases. Each LoopInvariantCodeMotion owns one./*{-{*/
+  struct AnalysisState {
+    LoopBudget Budget;
+    AnalysisAbort Abort;
+    EngineCounters Counters;
+    bool TimePhases = false;
+    StringMap<double> PhaseTimes; // Wall seconds per phase, of this loop
+  };/*}-}*/
+
+  // The state of the analysis running on this thread, the relation engine
+  // has no other way to reach it. The default one serves the relations built
+  // out of an analysis.
+  static thread_local AnalysisState DefaultState;
+  static thread_local AnalysisState* CurState = nullptr;
+  // The time of the phases of all the loops analyzed on this thread
+  static thread_local StringMap<double> PhaseTotals;
+
+  static AnalysisState &getAnalysisState(){
+    return CurState ? *CurState : DefaultState;
+  }
+
+  /// Run the analysis of this thread with the state S while in scope, its
+  /// counters are then merged in the statistics./*{-{*/
+  class AnalysisStateScope {
+    AnalysisState* Prev;
+  public:
+    AnalysisStateScope(AnalysisState &S) : Prev(CurState) {
+      CurState = &S;
+    }
+    ~AnalysisStateScope(){
+      CurState->Counters.flush();
+      for(auto &P : CurState->PhaseTimes)
+        PhaseTotals[P.getKey()] += P.getValue();
+      CurState->PhaseTimes.clear();
+      CurState = Prev;
+    }
+  };/*}-}*/
+
+  // A string argument of a remark, ore::NV does not take strings/*{-{*/
+  static DiagnosticInfoOptimizationBase::Argument
+  getRemarkString(const char* Key, StringRef Val){
+    DiagnosticInfoOptimizationBase::Argument A;
+    A.Key = Key;
+    A.Val = Val.str();
+    return A;
+  }/*}-}*/
+
+  // The debug location of V, an instruction or a block/*{-{*/
+  static DebugLoc getRemarkLoc(Value* V, Loop* L){
+    if(Instruction* I = dyn_cast_or_null<Instruction>(V))
+      if(I->getDebugLoc())
+        return I->getDebugLoc();
+    if(BasicBlock* BB = dyn_cast_or_null<BasicBlock>(V))
+      for(Instruction &I : *BB)
+        if(I.getDebugLoc())
+          return I.getDebugLoc();
+    return L->getStartLoc();
+  }/*}-}*/
+
+  // The name of a command in the remarks and the report. clang discards the
+  // names of the values, they are then printed as operands (%12)./*{-{*/
+  static std::string getCommandName(Value* V, ModuleSlotTracker &MST){
+    if(V->hasName())
+      return V->getName().str();
+    std::string Name;
+    raw_string_ostream OS(Name);
+    V->printAsOperand(OS, false, MST);
+    return OS.str();
+  }/*}-}*/
+
+  // A command of L in a remark, at its debug location: the start of the
+  // loop for an inner loop/*{-{*/
+  static DiagnosticInfoOptimizationBase::Argument
+  getRemarkCommand(Value* V, StringRef Name, Loop* L, LoopInfo* LI){
+    DiagnosticInfoOptimizationBase::Argument A = getRemarkString("Command",
+                                                                 Name);
+    Loop* Inner = isa<BasicBlock>(V) ? LI->getLoopFor(cast<BasicBlock>(V))
+                                     : nullptr;
+    A.DLoc = Inner && Inner != L && Inner->getHeader() == V
+      ? Inner->getStartLoc() : getRemarkLoc(V, L);
+    return A;
+  }/*}-}*/
+
+  /// Time a phase of LQICM in the "lqicm" group of -time-passes. The time
+  /// spent on each loop is printed with -debug-only=lqicm-time and kept in
+  /// the analysis state with -lqicm-time-phases./*{-{*/
+  class PhaseTimer {
+    NamedRegionTimer T;
+    StringRef Name, Desc;
+    const Loop* L;
+    bool Keep;
+    TimeRecord Start;
+  public:
+    PhaseTimer(StringRef Name, StringRef Desc, const Loop* L)
+      : T(Name, Desc, "lqicm", "LQICM phases", TimePassesIsEnabled),
+        Name(Name), Desc(Desc), L(L),
+        Keep(getAnalysisState().TimePhases) {
+      if(Keep)
+        Start = TimeRecord::getCurrentTime(true);
+      DEBUG_WITH_TYPE("lqicm-time", Start = TimeRecord::getCurrentTime(true));
+    }
+    ~PhaseTimer(){
+      TimeRecord Elapsed;
+      if(Keep){
+        Elapsed = TimeRecord::getCurrentTime(false);
+        Elapsed -= Start;
+        getAnalysisState().PhaseTimes[Name] += Elapsed.getWallTime();
+      }
+      DEBUG_WITH_TYPE("lqicm-time", {
+          Elapsed = TimeRecord::getCurrentTime(false);
+          Elapsed -= Start;
+          dbgs() << "lqicm-time: " << Desc << " of "
+                 << L->getHeader()->getParent()->getName() << ":"
+                 << L->getHeader()->getName() << " (depth "
+                 << L->getLoopDepth() << "): "
+                 << format("%.6f", Elapsed.getProcessTime()) << "s\n";
+        });
+    }
+  };/*}-}*/
+
   VSet mergeVSet(const VSet s1, const VSet s2){
     VSet s(s1);
     for (auto VV = s2.begin(), E = s2.end(); VV != E; ++VV) {
@@ -540,6 +830,14 @@ namespace llvm {
     /// 
     Relation* composition(Relation* r2){
       DEBUG(dbgs() << " Composition is called… " << '\n');
+      AnalysisState &State = getAnalysisState();
+      LoopBudget &Budget = State.Budget;
+      ++State.Counters.Compositions;
+      // The loop is given up, don't spend more time on it
+      if(Budget.Exceeded)
+        return this;
+      addToHistogram(State.Counters.CompositionDeps,
+                     dep.size() + r2->dep.size(), 4, 4);
       if(variables.empty())
         return r2;
       if(r2->variables.empty())
@@ -553,6 +851,12 @@ namespace llvm {
       /* DEBUG(R2->dump(dbgs())); */
 
       Relation* comp = new Relation(R1->variables);
+      updateMax(State.Counters.VSetSize, R1->variables.size());
+      if(!Budget.check(R1->variables.size(), Budget.MaxVariables,
+                       "relation variables") ||
+         !Budget.check(R1->dep.size() + R2->dep.size(), Budget.MaxArrows,
+                       "arrows"))
+        return comp;
       if(isAnchor() || r2->isAnchor())
         comp->setAnchor(true);
       comp->instructions = mergeVSet(instructions,r2->instructions);
@@ -783,6 +1087,14 @@ namespace llvm {
       return dep;
     }
 
+    unsigned getNumVariables(){
+      return variables.size();
+    }
+
+    unsigned getNumArrows(){
+      return dep.size();
+    }
+
     /* VSet getOut(){ */
     /*   return out; */
     /* } */
@@ -985,11 +1297,16 @@ namespace llvm {
   }; // End Chunk
 
   typedef SmallDenseMap<Value*, Chunk*> MapChunk;
+  // Degrees of a command from its own loop to the outermost analyzed one
+  typedef SmallVector<int, 4> DegVec;
+  typedef ValueMap<Value*, DegVec> MapDegVec;
 
   struct LoopInvariantCodeMotion {
     bool runOnLoop(Loop *L, AliasAnalysis *AA, LoopInfo *LI, DominatorTree *DT,
-                   DependenceInfo *DI, PostDominatorTree *PDT, ScalarEvolution
-                   *SE, bool DeleteAST);
+                   DependenceInfo *DI, PostDominatorTree *PDT, RegionInfo *RI,
+                   function_ref<void()> UpdateRegions, ScalarEvolution *SE, const TargetTransformInfo *TTI,
+                   BlockFrequencyInfo *BFI, OptimizationRemarkEmitter *ORE,
+                   bool DeleteAST);
 
     DenseMap<Loop *, AliasSetTracker *> &getLoopToAliasSetMap() {
       return LoopToAliasSetMap;
@@ -997,9 +1314,17 @@ namespace llvm {
     MapChunk &getMapChunk() {
       return mapChunk;
     }
+    MapDegVec &getDegreeVectors() {
+      return DegreeVectors;
+    }
+    AnalysisState &getState() {
+      return State;
+    }
 
   private:
     MapChunk mapChunk;
+    MapDegVec DegreeVectors;
+    AnalysisState State;
 
     DenseMap<Loop *, AliasSetTracker *> LoopToAliasSetMap;
 
@@ -1022,6 +1347,71 @@ namespace llvm {
     DEBUG(dbgs() << " ------------ " << '\n');
   }
 
+  // Write the degree of the instruction I, read by getLQICMDegree/*{-{*/
+  static void setDegreeMetadata(Instruction* I, int Deg){
+    LLVMContext &Ctx = I->getContext();
+    Metadata* Op =
+      ConstantAsMetadata::get(ConstantInt::get(Type::getInt32Ty(Ctx), Deg));
+    I->setMetadata(DegreeMDKind, MDNode::get(Ctx, Op));
+  }/*}-}*/
+
+  /// A copy of the loop ID of L whose entry Name is !{Name, i32 Val}, or
+  /// without Name when Val is None./*{-{*/
+  static MDNode* getLoopIDWith(Loop* L, StringRef Name, Optional<int> Val){
+    LLVMContext &Ctx = L->getHeader()->getContext();
+    SmallVector<Metadata*, 4> MDs(1);
+    if(MDNode* LoopID = L->getLoopID())
+      for(unsigned i = 1, e = LoopID->getNumOperands(); i < e; ++i){
+        MDNode* MD = dyn_cast<MDNode>(LoopID->getOperand(i));
+        MDString* S = MD && MD->getNumOperands() ?
+          dyn_cast<MDString>(MD->getOperand(0)) : nullptr;
+        if(!S || S->getString() != Name)
+          MDs.push_back(LoopID->getOperand(i));
+      }
+    if(Val){
+      Metadata* Vals[] = {
+        MDString::get(Ctx, Name),
+        ConstantAsMetadata::get(ConstantInt::get(Type::getInt32Ty(Ctx), *Val))
+      };
+      MDs.push_back(MDNode::get(Ctx, Vals));
+    }
+    MDNode* NewLoopID = MDNode::get(Ctx, MDs);
+    NewLoopID->replaceOperandWith(0, NewLoopID);
+    return NewLoopID;
+  }/*}-}*/
+
+  /// Write the degree of L in its parent in its loop ID, read by
+  /// getLQICMLoopDegree. An older degree is replaced./*{-{*/
+  static void setLoopDegreeMetadata(Loop* L, int Deg){
+    L->setLoopID(getLoopIDWith(L, LoopDegreeMDName, Deg));
+  }/*}-}*/
+
+  /// Write the degrees of the commands of L: the instructions and forks of
+  /// its body and its inner loops. Commands of inner loops keep the degree
+  /// in their own loop. A degree of 0 was not computed, it is not written: -1
+  /// means not invariant./*{-{*/
+  static unsigned annotateDegrees(Loop* L, MapDeg* mapDeg, LoopInfo* LI){
+    unsigned NumAnnotated = 0;
+    for(auto DD = mapDeg->begin(), DDE = mapDeg->end(); DD != DDE; ++DD){
+      int Deg = DD->second;
+      if(!Deg)
+        continue;
+      if(BasicBlock* BB = dyn_cast<BasicBlock>(DD->first)){
+        Loop* Inner = LI->getLoopFor(BB);
+        if(!Inner || Inner->getHeader() != BB || Inner->getParentLoop() != L)
+          continue;
+        setLoopDegreeMetadata(Inner, Deg);
+      } else if(Instruction* I = dyn_cast<Instruction>(DD->first)){
+        if(LI->getLoopFor(I->getParent()) != L)
+          continue;
+        setDegreeMetadata(I, Deg);
+      } else
+        continue;
+      NumAnnotated++;
+    }
+    return NumAnnotated;
+  }/*}-}*/
+
   static void dumpMapDegOfOC(MapChunk *mapChunk, MapDeg* mapDeg,
                              std::vector<Value*> *OC, raw_ostream &OS){
     DEBUG(dbgs() << "\n---- MapDegOfOC ----\n");
@@ -1208,13 +1598,47 @@ namespace llvm {
   }
 
   // Computes fixpoint relation (for loops)
+  /// Relation of a loop given up by the analysis: its outputs depend on all
+  /// its inputs and it is an anchor./*{-{*/
+  static Relation* getOpaqueLoopRelation(Loop* L){
+    VSet In, Out;
+    for(BasicBlock* BB : L->blocks())
+      for(Instruction &I : *BB){
+        for(Value* Op : I.operands()){
+          Instruction* OpI = dyn_cast<Instruction>(Op);
+          if(isa<Argument>(Op) || (OpI && !L->contains(OpI)))
+            In.insert(Op);
+        }
+        for(User* U : I.users())
+          if(!L->contains(cast<Instruction>(U)))
+            Out.insert(&I);
+      }
+    Relation* R = new Relation();
+    for(Value* Y : Out){
+      R->addVariable(Y);
+      for(Value* X : In){
+        R->addVariable(X);
+        R->addDependence(X, Y);
+      }
+    }
+    R->setAnchor(true);
+    return R;
+  }/*}-}*/
+
   static Relation* fixPoint(Relation* R){/*{-{*/
     Relation* r = new Relation();
     Relation* nextR(R);
+    AnalysisState &State = getAnalysisState();
+    unsigned Iterations = 0;
     while(!r->isEqual(nextR)){
       r = nextR;
       nextR=r->composition(R)->sumRelation(R);
+      ++Iterations;
+      if(!State.Budget.check(Iterations, State.Budget.MaxFixPointRounds,
+                             "fixpoint rounds"))
+        break;
     }
+    addToHistogram(State.Counters.FixPointRounds, Iterations, 2, 2);
     return r;
   }
   /*}-}*/
@@ -1227,6 +1651,43 @@ namespace llvm {
       initializeLegacyLQICMPassPass(*PassRegistry::getPassRegistry());
     }
 
+    // The block frequencies of the function, computed only with profile
+    // data, once per function and again when its CFG changes
+    Function* ProfiledF = nullptr;
+    std::unique_ptr<BranchProbabilityInfo> BPI;
+    std::unique_ptr<BlockFrequencyInfo> BFI;
+
+    BlockFrequencyInfo* getProfileBFI(Function &F, LoopInfo &LI){/*{-{*/
+      if(!F.getEntryCount())
+        return nullptr;
+      if(ProfiledF != &F){
+        BPI = make_unique<BranchProbabilityInfo>(F, LI);
+        BFI = make_unique<BlockFrequencyInfo>(F, *BPI, LI);
+        ProfiledF = &F;
+      }
+      return BFI.get();
+    }/*}-}*/
+
+    // The post-dominators, the dominance frontier and the regions are stale
+    // once a loop changed, they are only recomputed for the next loop
+    // reaching the analysis
+    bool RegionsStale = false;
+
+    void updateRegions(Function &F){/*{-{*/
+      if(!RegionsStale)
+        return;
+      auto &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+      auto &PDT = getAnalysis<PostDominatorTreeWrapperPass>().getPostDomTree();
+      auto &DF =
+        getAnalysis<DominanceFrontierWrapperPass>().getDominanceFrontier();
+      PDT.recalculate(F);
+      DF.releaseMemory();
+      DF.analyze(DT);
+      getAnalysis<RegionInfoPass>().getRegionInfo().recalculate(F, &DT, &PDT,
+                                                                &DF);
+      RegionsStale = false;
+    }/*}-}*/
+
     bool runOnLoop(Loop *L, LPPassManager &LPM) override {
       NumLoops++;
       DepthLoop+=L->getLoopDepth();
@@ -1243,14 +1704,31 @@ namespace llvm {
       auto *SE = getAnalysisIfAvailable<ScalarEvolutionWrapperPass>();
 
       Function &F = *L->getHeader()->getParent();
-      return LQICM.runOnLoop(L,
+      // For the old PM, we can't use OptimizationRemarkEmitter as an analysis
+      // pass, construct it here.
+      OptimizationRemarkEmitter ORE(&F);
+      bool Changed = LQICM.runOnLoop(L,
                              &getAnalysis<AAResultsWrapperPass>().getAAResults(),
                              &getAnalysis<LoopInfoWrapperPass>().getLoopInfo(),
                              &getAnalysis<DominatorTreeWrapperPass>().getDomTree(),
                              /* &getAnalysis<TargetLibraryInfoWrapperPass>().getTLI(), */
                              &getAnalysis<DependenceAnalysisWrapperPass>().getDI(),
                              &getAnalysis<PostDominatorTreeWrapperPass>().getPostDomTree(),
-                             SE ? &SE->getSE() : nullptr, false); }
+                             &getAnalysis<RegionInfoPass>().getRegionInfo(),
+                             [&]{ updateRegions(F); },
+                             SE ? &SE->getSE() : nullptr,
+                             &getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F),
+                             getProfileBFI(F,
+                               getAnalysis<LoopInfoWrapperPass>().getLoopInfo()),
+                             &ORE, false);
+      if (Changed) {
+        // The CFG has changed, the function analyses used by the next loops
+        // have to follow
+        RegionsStale = true;
+        ProfiledF = nullptr;
+      }
+      return Changed;
+    }
 
       /// This transformation requires natural loop information & requires that
       /// loop preheaders be inserted into the CFG...
@@ -1260,6 +1738,9 @@ namespace llvm {
         /* AU.addRequired<TargetLibraryInfoWrapperPass>(); */
         AU.addRequired<DependenceAnalysisWrapperPass>();
         AU.addRequired<PostDominatorTreeWrapperPass>();
+        AU.addRequired<TargetTransformInfoWrapperPass>();
+        AU.addRequired<DominanceFrontierWrapperPass>();
+        AU.addRequired<RegionInfoPass>();
         getLoopAnalysisUsage(AU);
         /* AU.getPreservesAll(); */
       }
@@ -1267,6 +1748,11 @@ namespace llvm {
       using llvm::Pass::doFinalization;
 
       bool doFinalization() override {
+        ProfiledF = nullptr;
+        RegionsStale = false;
+        BFI.reset();
+        BPI.reset();
+        LQICM.getDegreeVectors().clear();
         LQICM.getMapChunk().shrink_and_clear();
         assert(LQICM.getMapChunk().empty() &&
                "Didn't free loop chunks");
@@ -1311,6 +1797,88 @@ namespace llvm {
     return true;
   }/*}-}*/
 
+  // Check whether the upstream peelLoop can peel this loop: it rewires the
+  // latch as the exiting branch, the loops exiting in their header have to be
+  // rotated first./*{-{*/
+  static bool canPeelUpstream(Loop *L) {
+    return canPeel(L) && L->isLoopExiting(L->getLoopLatch());
+  }/*}-}*/
+
+  // Peel count computed by the analysis-only mode, read back by
+  // LegacyLQICMPeelPass
+  static const char* PeelCountMetadata = "llvm.loop.peel.count";
+
+  /// Attach the peel count of L to the exiting branch of its header: the
+  /// loop rotation merges the header in the latch, this branch becomes the
+  /// latch of the rotated loop and holds its loop ID. A loop already rotated
+  /// (its header is its latch) gets it directly./*{-{*/
+  static void setRotatedPeelCount(Loop* L, unsigned PeelCount){
+    MDNode* LoopID = getLoopIDWith(L, PeelCountMetadata, PeelCount);
+    L->getHeader()->getTerminator()->setMetadata(LLVMContext::MD_loop, LoopID);
+  }/*}-}*/
+
+  /// Peel L as many times as its llvm.loop.peel.count with the peeling of
+  /// LoopUnroll. The count is consumed: it's removed once read, the loop is
+  /// peeled only once./*{-{*/
+  static bool peelAnnotatedLoop(Loop* L, LoopInfo* LI, ScalarEvolution* SE,
+                                DominatorTree* DT, bool PreserveLCSSA){
+    Optional<const MDOperand*> Count =
+      findStringMetadataForLoop(L, PeelCountMetadata);
+    if(!Count)
+      return false;
+    ConstantInt* CI = mdconst::dyn_extract<ConstantInt>(**Count);
+    unsigned PeelCount = CI ? CI->getZExtValue() : 0;
+    // The rotation copied the header branch, and its loop ID, in the guard
+    // of the loop
+    MDNode* LoopID = L->getLoopID();
+    if(BasicBlock* Preheader = L->getLoopPreheader()){
+      SmallVector<BasicBlock*, 2> Guards(1, Preheader);
+      if(BasicBlock* Guard = Preheader->getSinglePredecessor())
+        Guards.push_back(Guard);
+      for(BasicBlock* BB : Guards)
+        if(BB->getTerminator()->getMetadata(LLVMContext::MD_loop) == LoopID)
+          BB->getTerminator()->setMetadata(LLVMContext::MD_loop, nullptr);
+    }
+    L->setLoopID(getLoopIDWith(L, PeelCountMetadata, None));
+    if(!PeelCount)
+      return true;
+    if(!canPeelUpstream(L)){
+      DEBUG(dbgs() << "The loop " << L->getHeader()->getName() <<
+            " was not rotated, it can't be peeled upstream\n");
+      return true;
+    }
+    DEBUG(dbgs() << "Peeling " << L->getHeader()->getName() << " " <<
+          PeelCount << " times upstream\n");
+    if(peelLoop(L, PeelCount, LI, SE, DT, PreserveLCSSA))
+      NumAnnotatedPeeled++;
+    return true;
+  }/*}-}*/
+
+  void initializeLegacyLQICMPeelPassPass(PassRegistry&);
+
+  /// Second half of -lqicm-peel-metadata: the loops annotated by LQICM and
+  /// rotated are peeled by the stock peeling, LICM runs after it.
+  struct LegacyLQICMPeelPass : public LoopPass {
+    static char ID; // Pass identification, replacement for typeid
+    LegacyLQICMPeelPass() : LoopPass(ID) {
+      initializeLegacyLQICMPeelPassPass(*PassRegistry::getPassRegistry());
+    }
+
+    bool runOnLoop(Loop *L, LPPassManager &LPM) override {
+      if (skipLoop(L))
+        return false;
+      return peelAnnotatedLoop(L,
+                               &getAnalysis<LoopInfoWrapperPass>().getLoopInfo(),
+                               &getAnalysis<ScalarEvolutionWrapperPass>().getSE(),
+                               &getAnalysis<DominatorTreeWrapperPass>().getDomTree(),
+                               true);
+    }
+
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+      getLoopAnalysisUsage(AU);
+    }
+  };
+
   /// \brief Update the branch weights of the latch of a peeled-off loop
   /// iteration.
   /// This sets the branch weights for the latch of the recently peeled off loop
@@ -1353,6 +1921,20 @@ namespace llvm {
     }
   }/*}-}*/
 
+  /// Erase Blocks from DT, their children moved under NewIDom first./*{-{*/
+  template <typename BlockRange>
+  static void eraseFromDomTree(BlockRange &&Blocks, BasicBlock *NewIDom,
+                               DominatorTree &DT) {
+    SmallVector<DomTreeNode*, 8> ChildNodes;
+    for (BasicBlock *BB : Blocks) {
+      ChildNodes.append(DT[BB]->begin(), DT[BB]->end());
+      for (DomTreeNode *ChildNode : ChildNodes)
+        DT.changeImmediateDominator(ChildNode, DT[NewIDom]);
+      ChildNodes.clear();
+      DT.eraseNode(BB);
+    }
+  }/*}-}*/
+
   /// Remove a loop.
   bool deleteLoop(Loop *L, DominatorTree &DT, ScalarEvolution &SE, LoopInfo/*{-{*/
                   &loopInfo, BSet* BBToRemove) {
@@ -1418,26 +2000,15 @@ namespace llvm {
     DEBUG(dbgs() << " OK\n");
 
 
-    // Update the dominator tree and remove the instructions and blocks that will
-    // be deleted from the reference counting scheme.
-    SmallVector<DomTreeNode*, 8> ChildNodes;
+    // Update the dominator tree: the children of the blocks become children
+    // of the preheader, which allows us to remove their domtree entries.
     DEBUG(dbgs() << " Update dominator tree…");
-    for (Loop::block_iterator LI = L->block_begin(), LE = L->block_end();
-         LI != LE; ++LI) {
-      // Move all of the block's children to be children of the preheader, which
-      // allows us to remove the domtree entry for the block.
-      ChildNodes.insert(ChildNodes.begin(), DT[*LI]->begin(), DT[*LI]->end());
-      for (DomTreeNode *ChildNode : ChildNodes) {
-        DT.changeImmediateDominator(ChildNode, DT[preheader]);
-      }
-
-      ChildNodes.clear();
-      DT.eraseNode(*LI);
+    eraseFromDomTree(L->blocks(), preheader, DT);
 
-      // Remove the block from the reference counting scheme, so that we can
-      // delete it freely later.
-      (*LI)->dropAllReferences();
-    }
+    // Remove the blocks from the reference counting scheme, so that we can
+    // delete them freely later.
+    for (BasicBlock *BB : L->blocks())
+      BB->dropAllReferences();
     DEBUG(dbgs() << " OK\n");
 
     // Erase the instructions and the blocks without having to worry
@@ -1469,222 +2040,1110 @@ namespace llvm {
   }/*}-}*/
 
 
-  // TODO
-  BSet removeChunkWithHead(BasicBlock *Head, Loop *L, ValueToValueMapTy &VMap, LoopInfo *LI){
-    BSet BBToRemove;
-    BBToRemove.insert(Head);
-  }
+  // Collect the blocks of the fork starting at Start and closed by End/*{-{*/
+  static void getForkBlocks(BasicBlock* Start, BasicBlock* End, BSet* blocks){
+    SmallVector<BasicBlock*, 8> WorkList;
+    for(unsigned i = 0; i < Start->getTerminator()->getNumSuccessors(); ++i)
+      WorkList.push_back(Start->getTerminator()->getSuccessor(i));
+    while(!WorkList.empty()){
+      BasicBlock* BB = WorkList.pop_back_val();
+      if(BB == End || !blocks->insert(BB).second)
+        continue;
+      for(unsigned i = 0; i < BB->getTerminator()->getNumSuccessors(); ++i)
+        WorkList.push_back(BB->getTerminator()->getSuccessor(i));
+    }
+  }/*}-}*/
 
-  // Remove chuncks with deg <= curDeg (except if < 0)/*{-{*/
-  VSet updateLoopBody(Loop* L, unsigned curDeg, MapChunk* mapChunk,
-                      ValueToValueMapTy &VMap, ScalarEvolution *SE,
-                      DominatorTree *DT, PostDominatorTree *PDT, LoopInfo *LI,
-                      std::vector<Value*> *OC){
-    DEBUG(dbgs() <<"CurDeg = " << curDeg << " :\n");
+  // Number of instructions of the command V: an instruction, the terminator/*{-{*/
+  // of a fork or the header of an inner loop
+  static unsigned getNumCommandInsts(Value* V, MapChunk* mapChunk,
+                                     LoopInfo* LI){
+    unsigned NumInsts = 0;
+    if(BasicBlock* InnerHead = dyn_cast<BasicBlock>(V)){
+      if(Loop* Inner = LI->getLoopFor(InnerHead))
+        for(BasicBlock* BB : Inner->blocks())
+          NumInsts += BB->size();
+      return NumInsts;
+    }
+    TerminatorInst* TI = dyn_cast<TerminatorInst>(V);
+    if(TI && mapChunk->count(TI) && (*mapChunk)[TI]->getEnd()){
+      BSet Blocks;
+      getForkBlocks(TI->getParent(), (*mapChunk)[TI]->getEnd(), &Blocks);
+      for(BasicBlock* BB : Blocks)
+        NumInsts += BB->size();
+    }
+    return NumInsts + 1;
+  }/*}-}*/
 
-    // If we are here, it works
+  /// Return true if the command V of the loop L (an instruction, the terminator
+  /// of a fork or the header of an inner loop) can be removed from the body
+  /// once L has been peeled as many times as its degree. Its value is then the
+  /// one computed by the last peeled iteration./*{-{*/
+  static bool isRemovableAfterPeel(Value* V, Loop* L, MapChunk* mapChunk,
+                                   MapDeg* mapDeg, DominatorTree* DT,
+                                   LoopInfo* LI){
+    auto DD = mapDeg->find(V);
+    if(DD == mapDeg->end() || DD->second < 1)
+      return false;
+    int deg = DD->second;
+    BasicBlock* Latch = L->getLoopLatch();
+
+    // Inner loop: its outputs are its LCSSA phis, they must be computed at the
+    // same time
+    if(BasicBlock* InnerHead = dyn_cast<BasicBlock>(V)){
+      Loop* Inner = LI->getLoopFor(InnerHead);
+      if(!Inner || Inner->getHeader() != InnerHead ||
+         Inner->getParentLoop() != L || !mapChunk->count(V))
+        return false;
+      Chunk* C = (*mapChunk)[V];
+      BasicBlock* Exit = Inner->getUniqueExitBlock();
+      if(C->isAnchor() || C->getType() == Chunk::ERROR || !Exit ||
+         !Inner->getLoopPreheader() || !Inner->hasDedicatedExits() ||
+         !DT->dominates(Exit, Latch))
+        return false;
+      for(BasicBlock::iterator I = Exit->begin(); isa<PHINode>(I); ++I){
+        auto PD = mapDeg->find(&*I);
+        if(PD == mapDeg->end() || PD->second < 1 || PD->second > deg)
+          return false;
+      }
+      return true;
+    }
+
+    Instruction* I = dyn_cast<Instruction>(V);
+    if(!I || I->getParent() == L->getHeader() ||
+       LI->getLoopFor(I->getParent()) != L ||
+       !DT->dominates(I->getParent(), Latch))
+      return false;
+
+    // Fork: the whole region is removed, its outputs are the phis of its end
+    if(isa<TerminatorInst>(I)){
+      if(!mapChunk->count(V))
+        return false;
+      Chunk* C = (*mapChunk)[V];
+      BasicBlock* IfEnd = C->getEnd();
+      if(C->getType() != Chunk::FORK || C->isAnchor() || !IfEnd ||
+         !DT->dominates(I->getParent(), IfEnd) || !DT->dominates(IfEnd, Latch))
+        return false;
+      // A direct edge to the end gives to its phis a value not in the relation
+      for(unsigned i = 0; i < I->getNumSuccessors(); ++i)
+        if(I->getSuccessor(i) == IfEnd && isa<PHINode>(IfEnd->begin()))
+          return false;
+      BSet blocks;
+      getForkBlocks(I->getParent(), IfEnd, &blocks);
+      for(BasicBlock* BB : blocks){
+        // Inner loops of the fork are not managed
+        if(LI->getLoopFor(BB) != L)
+          return false;
+        for(Instruction &FI : *BB)
+          for(User* U : FI.users()){
+            Instruction* UI = cast<Instruction>(U);
+            if(!blocks.count(UI->getParent()) &&
+               !(UI->getParent() == IfEnd && isa<PHINode>(UI)))
+              return false;
+          }
+      }
+      return true;
+    }
+
+    return !I->mayHaveSideEffects();
+  }/*}-}*/
+
+  // Number of iterations to peel to remove all the removable commands
+  static unsigned getPeelCount(Loop* L, MapChunk* mapChunk,/*{-{*/
+                               std::vector<Value*> *OC, DominatorTree* DT,
+                               LoopInfo* LI){
     Value* head = dyn_cast<Value>(L->getHeader());
+    MapDeg *mapDeg = (*mapChunk)[head]->getMapDeg();
+    int degMax = 0;
+    for(Value* V : *OC)
+      if(isRemovableAfterPeel(V, L, mapChunk, mapDeg, DT, LI))
+        degMax = std::max(degMax, (*mapDeg)[V]);
+    return degMax;
+  }/*}-}*/
 
-    Chunk* currentChunk = (*mapChunk)[head];
-    MapDeg *mapDeg = currentChunk->getMapDeg();
+  // Size of a block regarding to the target/*{-{*/
+  static unsigned getBlockCost(BasicBlock* BB, const TargetTransformInfo* TTI){
+    unsigned cost = 0;
+    for(Instruction &I : *BB)
+      cost += TTI->getUserCost(&I);
+    return cost;
+  }/*}-}*/
 
-    std::vector<Loop*> LoopToRemove;
-    ISet toRemove;
-    VSet toClean;
-    BSet BBToRemove;
+  // Size of the body of a loop (inner loops included)/*{-{*/
+  static unsigned getLoopCost(Loop* L, const TargetTransformInfo* TTI){
+    unsigned cost = 0;
+    for(BasicBlock* BB : L->blocks())
+      cost += getBlockCost(BB, TTI);
+    return cost;
+  }/*}-}*/
 
-    //TODO it's faster to reuse the ordered chunks/commands which has a degree
-    //computed
-    /* for(Value* VI : *OC){ */
-    /*   DEBUG(dbgs() << "Treating: " << VI << " … " ); */
-
-    /*   // If it's not the degree we are looking for continue… */
-    /*   if((*mapDeg)[VI] != curDeg){ */
-    /*     continue; */
-    /*   } */
-
-    /*   if((*mapChunk)[I]){ */
-    /*     DEBUG(dbgs() << "\n↑ It's the beginning of an inner Chunk with end: " */
-    /*           << ((*mapChunk)[I])->getEnd()->getName()); */
-    /*     DEBUG(dbgs() << "to remove… \n"); */
-    /*     //TODO recursivly remove chunk */
-    /*     // removeChunk(…)… */
-    /*   } */
-
-    /*   //If it's a simple instruction */
-    /*   if(Instruction* I = dyn_cast<Instruction>(VI)){ */
-
-    /*     //If it's a Terminator then it's the key of a fork if-then-else like */
-    /*     if(isa<TerminatorInst>(&I)){ */
-    /*       DEBUG(dbgs() <<"Start of a registered branch we need to hoist"<< */
-    /*             " with deg = " << (*mapDeg)[VI] << "\n"); */
-    /*       TerminatorInst *TInst = dyn_cast<TerminatorInst>(&I); */
-    /*       // Put the branches to the garbage */
-    /*       BasicBlock *Then = TInst->getSuccessor(0); */
-    /*       BasicBlock *Else = TInst->getSuccessor(1); */
-    /*       BBToRemove.insert(Then); */
-    /*       BBToRemove.insert(Else); */
-    /*       // Modify the TInst to go directly to the if.end… */
-    /*       BasicBlock *IfEnd = PDT->findNearestCommonDominator(Then,Else); */
-    /*       BranchInst* br = llvm::BranchInst::Create(IfEnd); */
-    /*       ReplaceInstWithInst(TInst->getParent()->getInstList(),LII,br); */
-
-    /*       // Now adjust the phi nodes in the ifEnd */
-    /*       for (BasicBlock::iterator PII = IfEnd->begin(); isa<PHINode>(PII); */
-    /*            ++PII) { */
-    /*         Instruction &PI = *PII; */
-    /*         toRemove.insert(&PI); */
-    /*       } */
-
-    /*       // Another cleaner thing is to merge IfEnd and BB */
-    /*       /1* MergeBlockIntoPredecessor(IfEnd); //Does not work… why? *1/ */
-    /*       // Don't care, other passes like simplifycfg will do it ;) */
-    /*     } */
-    /*     else{ */
-    /*       // If it's just a basic Instruction just remove it */
-    /*       toRemove.insert(&I); */
-    /*       DEBUG(dbgs() << "to remove… \n"); */
-    /*     } */
-    /*     continue; */
-    /*   } */
-    /*   else{ */
-    /*     DEBUG(dbgs() <<" WARN: A command in OC is not an Instruction nor a */
-    /*           chunk… " << "\n"); */
-    /*   } */
-    /* } */
+  /// Work done on each iteration of L by the command V. An inner loop costs
+  /// its body times its trip count, \p UnknownTripCount if it's unknown./*{-{*/
+  static unsigned getChunkCost(Value* V, Loop* L, MapChunk* mapChunk,
+                               LoopInfo* LI, ScalarEvolution* SE,
+                               const TargetTransformInfo* TTI,
+                               unsigned UnknownTripCount){
+    if(BasicBlock* InnerHead = dyn_cast<BasicBlock>(V)){
+      Loop* Inner = LI->getLoopFor(InnerHead);
+      unsigned TripCount = SE->getSmallConstantTripCount(Inner);
+      if(!TripCount)
+        TripCount = UnknownTripCount;
+      return getLoopCost(Inner, TTI) * TripCount;
+    }
+    Instruction* I = cast<Instruction>(V);
+    unsigned cost = TTI->getUserCost(I);
+    if(isa<TerminatorInst>(I) && mapChunk->count(V)){
+      BSet blocks;
+      getForkBlocks(I->getParent(), (*mapChunk)[V]->getEnd(), &blocks);
+      for(BasicBlock* BB : blocks)
+        cost += getBlockCost(BB, TTI);
+    }
+    return cost;
+  }/*}-}*/
 
-    // DEPRECATED ↓
-    for (BasicBlock *BB : L->blocks()){
-      if(BB != L->getHeader()){
-        for(BasicBlock::iterator LII = BB->begin(), LE = BB->end(); LII != LE;
-            ++LII){
-          Instruction &I = *LII;
-          DEBUG(dbgs() << "Treating: " << I << " … " );
-          if(Value* VI = dyn_cast<Value>(&I)){
-            if((*mapDeg)[VI] == curDeg){
-              if(isa<Instruction>(&I)){
-                if(isa<TerminatorInst>(&I)){
-                  DEBUG(dbgs() <<"Start of a registered branch we need to hoist"<<
-                        " with deg = " << (*mapDeg)[VI] << "\n");
-                  TerminatorInst *TInst = dyn_cast<TerminatorInst>(&I);
-                  // Put the branches to the garbage
-                  BasicBlock *Then = TInst->getSuccessor(0);
-                  BasicBlock *Else = TInst->getSuccessor(1);
-                  BBToRemove.insert(Then);
-                  BBToRemove.insert(Else);
-                  // Modify the TInst to go directly to the if.end…
-                  BasicBlock *IfEnd = PDT->findNearestCommonDominator(Then,Else);
-                  BranchInst* br = llvm::BranchInst::Create(IfEnd);
-                  ReplaceInstWithInst(TInst->getParent()->getInstList(),LII,br);
-
-                  // Now adjust the phi nodes in the ifEnd
-                  for (BasicBlock::iterator PII = IfEnd->begin(); isa<PHINode>(PII);
-                       ++PII) {
-                    Instruction &PI = *PII;
-                    toRemove.insert(&PI);
-                  }
-
-                  // Another cleaner thing is to merge IfEnd and BB
-                  /* MergeBlockIntoPredecessor(IfEnd); //Does not work… why? */
-                  // Don't care, other passes like simplifycfg will do it ;)
-                }
-                else{
-                  toRemove.insert(&I);
-                  DEBUG(dbgs() << "to remove… \n");
-                }
-              }
-              else{
-                DEBUG(dbgs() <<"Trying to remove an entire block… of value "<<
-                      *LII << " with deg = " << (*mapDeg)[VI] << "\n");
-              }
-            }
-            else DEBUG(dbgs() << "OK \n");
-          }
-          else
-            DEBUG(dbgs() <<"**************ERROR dyn_cast****************\n");
+  /// Estimation of what is paid and what is saved by peeling L.
+  struct PeelCost {
+    unsigned PeelCount = 0;
+    unsigned BodySize = 0;   // Size of the body before peeling
+    unsigned ClonedSize = 0; // Size of all the peeled iterations
+    unsigned Saved = 0;      // Work saved on each remaining iteration
+    unsigned NumChunks = 0;  // Number of commands removed from the body
+  };
+
+  // Compute the cost of peeling L PeelCount times/*{-{*/
+  static PeelCost computePeelCost(Loop* L, unsigned PeelCount,
+                                  MapChunk* mapChunk, std::vector<Value*> *OC,
+                                  DominatorTree* DT, LoopInfo* LI,
+                                  ScalarEvolution* SE,
+                                  const TargetTransformInfo* TTI,
+                                  unsigned UnknownTripCount){
+    PeelCost PC;
+    PC.PeelCount = PeelCount;
+    PC.BodySize = getLoopCost(L, TTI);
+    PC.ClonedSize = PC.BodySize * PeelCount;
+    Value* head = dyn_cast<Value>(L->getHeader());
+    MapDeg *mapDeg = (*mapChunk)[head]->getMapDeg();
+    for(Value* V : *OC){
+      if(!isRemovableAfterPeel(V, L, mapChunk, mapDeg, DT, LI) ||
+         (*mapDeg)[V] > (int)PeelCount)
+        continue;
+      PC.Saved += getChunkCost(V, L, mapChunk, LI, SE, TTI, UnknownTripCount);
+      PC.NumChunks++;
+    }
+    DEBUG(dbgs() << "PeelCost: count = " << PC.PeelCount << " body = " <<
+          PC.BodySize << " cloned = " << PC.ClonedSize << " saved = " <<
+          PC.Saved << '\n');
+    return PC;
+  }/*}-}*/
+
+  // Forget everything we know about a removed command
+  static void forgetValue(Value* V, MapChunk* mapChunk, MapDeg* mapDeg){/*{-{*/
+    mapDeg->erase(V);
+    mapChunk->erase(V);
+  }/*}-}*/
+
+  /// A chunk moved as a whole out of its loop: the terminator of Src enters
+  /// the Blocks of the chunk, which all leave to End. The phis of End are the
+  /// outputs of the chunk. The invariant instructions of the loop it needs
+  /// (the Slice, in def-use order) are copied with it.
+  struct HoistableChunk {
+    BasicBlock* Src = nullptr;
+    BasicBlock* End = nullptr;
+    BSet Blocks;
+    Loop* Inner = nullptr; // The inner loop of the chunk, if any
+    SmallSetVector<Instruction*, 8> Slice;
+  };
+
+  // Is V computed before entering L or by the chunk itself?/*{-{*/
+  static bool isAvailableBeforeLoop(Value* V, Loop* L, BSet* Blocks){
+    Instruction* I = dyn_cast<Instruction>(V);
+    return !I || !L->contains(I->getParent()) || Blocks->count(I->getParent());
+  }/*}-}*/
+
+  /// Return true if V is available before L or is computed in L by pure
+  /// instructions from values available before L. These instructions are
+  /// added to Slice, operands first./*{-{*/
+  static bool collectInvariantSlice(Value* V, Loop* L, BSet* Blocks,
+                                    SmallSetVector<Instruction*, 8> &Slice){
+    if(isAvailableBeforeLoop(V, L, Blocks))
+      return true;
+    Instruction* I = cast<Instruction>(V);
+    if(Slice.count(I))
+      return true;
+    if(isa<PHINode>(I) || I->mayHaveSideEffects() || I->mayReadFromMemory() ||
+       !isSafeToSpeculativelyExecute(I))
+      return false;
+    for(Value* Op : I->operands())
+      if(!collectInvariantSlice(Op, L, Blocks, Slice))
+        return false;
+    Slice.insert(I);
+    return true;
+  }/*}-}*/
+
+  /// Find the blocks of the command V of L, an inner loop or a fork./*{-{*/
+  static bool getChunkRegion(Value* V, Loop* L, MapChunk* mapChunk,
+                             LoopInfo* LI, HoistableChunk &HC){
+    if(!mapChunk->count(V))
+      return false;
+    Chunk* C = (*mapChunk)[V];
+    if(C->isAnchor() || C->getType() == Chunk::ERROR)
+      return false;
+
+    if(BasicBlock* InnerHead = dyn_cast<BasicBlock>(V)){
+      Loop* Inner = LI->getLoopFor(InnerHead);
+      if(!Inner || Inner->getHeader() != InnerHead ||
+         Inner->getParentLoop() != L || !Inner->hasDedicatedExits())
+        return false;
+      HC.Inner = Inner;
+      HC.Src = Inner->getLoopPreheader();
+      HC.End = Inner->getUniqueExitBlock();
+      HC.Blocks.insert(Inner->block_begin(), Inner->block_end());
+      return HC.Src && HC.End;
+    }
+    if(TerminatorInst* TI = dyn_cast<TerminatorInst>(V)){
+      if(C->getType() != Chunk::FORK || !C->getEnd() ||
+         LI->getLoopFor(TI->getParent()) != L)
+        return false;
+      HC.Src = TI->getParent();
+      HC.End = C->getEnd();
+      getForkBlocks(HC.Src, HC.End, &HC.Blocks);
+      // Inner loops of the fork are not managed
+      for(BasicBlock* BB : HC.Blocks)
+        if(LI->getLoopFor(BB) != L)
+          return false;
+      return true;
+    }
+    return false;
+  }/*}-}*/
+
+  /// Return true if the region of HC, in L, is single entry, single exit and
+  /// pure. Each operand read by the region is given to \p Use, which may
+  /// reject it. When \p Speculate is false it must run on each iteration of
+  /// L, otherwise each of its instructions must be safe to speculate./*{-{*/
+  static bool isPureRegion(Loop* L, HoistableChunk &HC, DominatorTree* DT,
+                           bool Speculate, function_ref<bool(Value*)> Use){
+    BasicBlock* Latch = L->getLoopLatch();
+    if(!HC.Src || !HC.End || HC.Src == L->getHeader() ||
+       !L->contains(HC.Src) || !L->contains(HC.End) ||
+       HC.Blocks.count(HC.Src))
+      return false;
+    if(!Speculate &&
+       (!DT->dominates(HC.Src, Latch) || !DT->dominates(HC.End, Latch)))
+      return false;
+    TerminatorInst* SrcTI = HC.Src->getTerminator();
+    if(!isa<BranchInst>(SrcTI) && !isa<SwitchInst>(SrcTI))
+      return false;
+    for(Value* Op : SrcTI->operands())
+      if(!isa<BasicBlock>(Op) && !Use(Op))
+        return false;
+
+    for(BasicBlock* BB : HC.Blocks){
+      for(BasicBlock* Pred : predecessors(BB))
+        if(Pred != HC.Src && !HC.Blocks.count(Pred))
+          return false;
+      for(BasicBlock* Succ : successors(BB))
+        if(Succ != HC.End && !HC.Blocks.count(Succ))
+          return false;
+      for(Instruction &I : *BB){
+        if(I.mayHaveSideEffects() || I.mayReadFromMemory() || I.isEHPad() ||
+           isa<AllocaInst>(&I))
+          return false;
+        // Run before its guard, a division could trap
+        if(Speculate && !isa<PHINode>(&I) && !isa<TerminatorInst>(&I) &&
+           !isSafeToSpeculativelyExecute(&I))
+          return false;
+        for(Value* Op : I.operands())
+          if(!isa<BasicBlock>(Op) && !Use(Op))
+            return false;
+        for(User* U : I.users()){
+          Instruction* UI = cast<Instruction>(U);
+          if(!HC.Blocks.count(UI->getParent()) &&
+             !(UI->getParent() == HC.End && isa<PHINode>(UI)))
+            return false;
         }
       }
-      if(inSubLoop(BB, L, LI)){
-        DEBUG(dbgs() << " BB " << BB << " is in an innerLoop \n");
-        Value* innerHead = dyn_cast<Value>(BB);
-        if((*mapChunk)[innerHead]){
-          DEBUG(dbgs() << " BB " << innerHead << " is the innerHead of the innerloop " << 
-                "with deg = " << (*mapDeg)[innerHead] << "\n");
-          if((*mapDeg)[innerHead] == curDeg){
-            Loop* innerLoop = LI->getLoopFor(BB);
-            if(deleteLoop(innerLoop, *DT, *SE, *LI, &BBToRemove)){
-              LoopToRemove.push_back(innerLoop);
-              DEBUG(dbgs() << " LOOP REMOVED! \n");
+    }
+
+    // Outputs: the phis of the end, fed only by the chunk
+    for(BasicBlock* Pred : predecessors(HC.End))
+      if(Pred != HC.Src && !HC.Blocks.count(Pred))
+        return false;
+    for(BasicBlock::iterator I = HC.End->begin(); isa<PHINode>(I); ++I)
+      for(Value* In : cast<PHINode>(&*I)->incoming_values())
+        if(!Use(In))
+          return false;
+    return true;
+  }/*}-}*/
+
+  /// Return true if the region of HC, in L, is single entry, single exit, pure
+  /// and only needs values available before L. When \p Speculate is false it
+  /// must run on each iteration of L./*{-{*/
+  static bool isHoistableRegion(Loop* L, HoistableChunk &HC, DominatorTree* DT,
+                                bool Speculate){
+    return isPureRegion(L, HC, DT, Speculate, [&](Value* Op){
+        return collectInvariantSlice(Op, L, &HC.Blocks, HC.Slice);
+      });
+  }/*}-}*/
+
+  /// Return true if the command V of L, an inner loop or a fork of degree 1,
+  /// only needs inputs computed before L and can be moved in its preheader.
+  /// HC describes the chunk then./*{-{*/
+  static bool isHoistableChunk(Value* V, Loop* L, MapChunk* mapChunk,
+                               MapDeg* mapDeg, DominatorTree* DT, LoopInfo* LI,
+                               HoistableChunk &HC){
+    auto DD = mapDeg->find(V);
+    if(DD == mapDeg->end() || DD->second != 1 ||
+       !getChunkRegion(V, L, mapChunk, LI, HC))
+      return false;
+    for(BasicBlock::iterator I = HC.End->begin(); isa<PHINode>(I); ++I){
+      auto PD = mapDeg->find(&*I);
+      if(PD == mapDeg->end() || PD->second != 1)
+        return false;
+    }
+    return isHoistableRegion(L, HC, DT, false);
+  }/*}-}*/
+
+  /// Clone before InsertPt the exit test of the first iteration of L: the
+  /// condition of the header where its phis take their value from the
+  /// preheader. Return nullptr if the header has no such condition./*{-{*/
+  static Value* getFirstIterationCondition(Loop* L, Instruction* InsertPt){
+    BasicBlock* Header = L->getHeader();
+    BasicBlock* Preheader = L->getLoopPreheader();
+    BranchInst* HeaderBR = dyn_cast<BranchInst>(Header->getTerminator());
+    if(!HeaderBR || !HeaderBR->isConditional())
+      return nullptr;
+
+    // The slice of the condition in the header
+    SmallPtrSet<Instruction*, 8> Slice;
+    SmallVector<Instruction*, 8> WorkList;
+    if(Instruction* CondI = dyn_cast<Instruction>(HeaderBR->getCondition()))
+      WorkList.push_back(CondI);
+    while(!WorkList.empty()){
+      Instruction* I = WorkList.pop_back_val();
+      if(I->getParent() != Header || isa<PHINode>(I) || !Slice.insert(I).second)
+        continue;
+      if(I->mayHaveSideEffects())
+        return nullptr;
+      for(Value* Op : I->operands())
+        if(Instruction* OpI = dyn_cast<Instruction>(Op))
+          WorkList.push_back(OpI);
+    }
+
+    ValueToValueMapTy VMap;
+    for(BasicBlock::iterator I = Header->begin(); isa<PHINode>(I); ++I){
+      PHINode* PN = cast<PHINode>(&*I);
+      VMap[PN] = PN->getIncomingValueForBlock(Preheader);
+    }
+    const DataLayout &DL = Header->getModule()->getDataLayout();
+    for(Instruction &I : *Header){
+      if(!Slice.count(&I))
+        continue;
+      Instruction* NewI = I.clone();
+      NewI->setName(I.getName() + ".first");
+      NewI->insertBefore(InsertPt);
+      RemapInstruction(NewI, VMap,
+                       RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+      VMap[&I] = NewI;
+      if(Constant* C = ConstantFoldInstruction(NewI, DL)){
+        VMap[&I] = C;
+        NewI->eraseFromParent();
+      }
+    }
+    Value* Cond = HeaderBR->getCondition();
+    if(Value* NewCond = VMap.lookup(Cond))
+      return NewCond;
+    return Cond;
+  }/*}-}*/
+
+  /// Move the chunk HC out of L, between the preheader and the header. It is
+  /// guarded by the exit test of the first iteration, the outputs of the chunk
+  /// are undefined when L doesn't run. Return false (and L is unchanged) if
+  /// the guard can't be built./*{-{*/
+  static bool hoistChunk(Loop* L, HoistableChunk &HC, LoopInfo* LI,
+                         DominatorTree* DT){
+    BasicBlock* Header = L->getHeader();
+    BasicBlock* Preheader = L->getLoopPreheader();
+    Loop* ParentLoop = L->getParentLoop();
+    Function* F = Header->getParent();
+    LLVMContext &Ctx = F->getContext();
+
+    Value* Cond = getFirstIterationCondition(L, Preheader->getTerminator());
+    if(!Cond)
+      return false;
+    BranchInst* HeaderBR = cast<BranchInst>(Header->getTerminator());
+    unsigned InIdx = L->contains(HeaderBR->getSuccessor(0)) ? 0 : 1;
+    bool Guarded = true;
+    if(ConstantInt* CI = dyn_cast<ConstantInt>(Cond))
+      Guarded = CI->isOne() != (InIdx == 0);
+
+    // Preheader → [HoistPH → chunk → HoistExit] → Landing → Header
+    BasicBlock* Landing = SplitEdge(Preheader, Header, DT, LI);
+    BasicBlock* HoistPH = BasicBlock::Create(Ctx, HC.Src->getName() + ".lqicm",
+                                             F, Landing);
+    BasicBlock* HoistExit = BasicBlock::Create(Ctx,
+                                               HC.End->getName() + ".lqicm",
+                                               F, Landing);
+    if(ParentLoop){
+      ParentLoop->addBasicBlockToLoop(HoistPH, *LI);
+      ParentLoop->addBasicBlockToLoop(HoistExit, *LI);
+    }
+    TerminatorInst* PreheaderTI = Preheader->getTerminator();
+    if(Guarded)
+      ReplaceInstWithInst(PreheaderTI, InIdx == 0 ?
+                          BranchInst::Create(HoistPH, Landing, Cond) :
+                          BranchInst::Create(Landing, HoistPH, Cond));
+    else
+      PreheaderTI->setSuccessor(0, HoistPH);
+
+    // The chunk is dominated by HoistPH instead of Src, End only by Src
+    BasicBlock* EndIDom = DT->getNode(HC.End)->getIDom()->getBlock();
+    DT->addNewBlock(HoistPH, Preheader);
+    DT->addNewBlock(HoistExit, HC.Blocks.count(EndIDom) ? EndIDom : HoistPH);
+    DT->changeImmediateDominator(HC.End, HC.Src);
+    for(BasicBlock* BB : HC.Blocks)
+      if(DT->getNode(BB)->getIDom()->getBlock() == HC.Src)
+        DT->changeImmediateDominator(BB, HoistPH);
+    if(!Guarded)
+      DT->changeImmediateDominator(Landing, HoistExit);
+
+    // The invariant instructions needed by the chunk are copied before it
+    ValueToValueMapTy SliceMap;
+    for(Instruction* I : HC.Slice){
+      Instruction* NewI = I->clone();
+      NewI->setName(I->getName() + ".lqicm");
+      HoistPH->getInstList().push_back(NewI);
+      RemapInstruction(NewI, SliceMap,
+                       RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+      SliceMap[I] = NewI;
+    }
+
+    // The chunk is entered from HoistPH and leaves to HoistExit, Src goes
+    // directly to End
+    TerminatorInst* SrcTI = HC.Src->getTerminator();
+    TerminatorInst* NewTI = SrcTI->clone();
+    HoistPH->getInstList().push_back(NewTI);
+    RemapInstruction(NewTI, SliceMap,
+                     RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+    for(unsigned i = 0; i < NewTI->getNumSuccessors(); ++i)
+      if(NewTI->getSuccessor(i) == HC.End)
+        NewTI->setSuccessor(i, HoistExit);
+    ReplaceInstWithInst(SrcTI, BranchInst::Create(HC.End));
+    for(BasicBlock* BB : HC.Blocks){
+      TerminatorInst* TI = BB->getTerminator();
+      for(unsigned i = 0; i < TI->getNumSuccessors(); ++i)
+        if(TI->getSuccessor(i) == HC.End)
+          TI->setSuccessor(i, HoistExit);
+      for(BasicBlock::iterator I = BB->begin(); isa<PHINode>(I); ++I){
+        PHINode* PN = cast<PHINode>(&*I);
+        for(int Idx; (Idx = PN->getBasicBlockIndex(HC.Src)) >= 0;)
+          PN->setIncomingBlock(Idx, HoistPH);
+      }
+      for(Instruction &I : *BB)
+        RemapInstruction(&I, SliceMap,
+                         RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+    }
+
+    // The phis of End move to HoistExit, L sees them through Landing
+    for(BasicBlock::iterator I = HC.End->begin(); isa<PHINode>(I);){
+      PHINode* PN = cast<PHINode>(&*I++);
+      PHINode* Out = PHINode::Create(PN->getType(), PN->getNumIncomingValues(),
+                                     PN->getName() + ".lqicm", HoistExit);
+      for(unsigned i = 0; i < PN->getNumIncomingValues(); ++i){
+        BasicBlock* In = PN->getIncomingBlock(i);
+        Value* InV = PN->getIncomingValue(i);
+        if(Value* SliceV = SliceMap.lookup(InV))
+          InV = SliceV;
+        Out->addIncoming(InV, In == HC.Src ? HoistPH : In);
+      }
+      Value* NewV = Out;
+      if(Guarded){
+        PHINode* LPN = PHINode::Create(PN->getType(), 2,
+                                       PN->getName() + ".lqicm",
+                                       &Landing->front());
+        LPN->addIncoming(Out, HoistExit);
+        LPN->addIncoming(UndefValue::get(PN->getType()), Preheader);
+        NewV = LPN;
+      }
+      PN->replaceAllUsesWith(NewV);
+      PN->eraseFromParent();
+    }
+    BranchInst::Create(Landing, HoistExit);
+
+    // The chunk leaves the loop nest of L
+    if(HC.Inner){
+      L->removeChildLoop(std::find(L->begin(), L->end(), HC.Inner));
+      if(ParentLoop)
+        ParentLoop->addChildLoop(HC.Inner);
+      else
+        LI->addTopLevelLoop(HC.Inner);
+    }
+    for(BasicBlock* BB : HC.Blocks){
+      L->removeBlockFromLoop(BB);
+      if(LI->getLoopFor(BB) == L)
+        LI->changeLoopFor(BB, ParentLoop);
+    }
+
+#ifndef NDEBUG
+    DT->verifyDomTree();
+#endif
+
+    // The chunk is now a command of the parent loop
+    HC.Src = HoistPH;
+    HC.End = HoistExit;
+    HC.Slice.clear();
+    return true;
+  }/*}-}*/
+
+  /// Move the inner loops and forks of degree 1 of L before L, without
+  /// peeling. Return the number of chunks hoisted./*{-{*/
+  static unsigned hoistInvariantChunks(Loop* L, MapChunk* mapChunk,
+                                       std::vector<Value*> *OC, LoopInfo* LI,
+                                       ScalarEvolution* SE, DominatorTree* DT){
+    Value* head = dyn_cast<Value>(L->getHeader());
+    MapDeg *mapDeg = (*mapChunk)[head]->getMapDeg();
+    unsigned NumHoisted = 0;
+    for(Value* V : *OC){
+      HoistableChunk HC;
+      if(!mapDeg->count(V) ||
+         !isHoistableChunk(V, L, mapChunk, mapDeg, DT, LI, HC))
+        continue;
+      DEBUG(dbgs() << "Hoisting the invariant chunk of " <<
+            HC.Src->getName() << " to " << HC.End->getName() << '\n');
+      if(!NumHoisted)
+        SE->forgetLoop(L);
+      std::vector<Value*> Outputs;
+      for(BasicBlock::iterator I = HC.End->begin(); isa<PHINode>(I); ++I)
+        Outputs.push_back(&*I);
+      // Without a guard nothing else can be hoisted
+      if(!hoistChunk(L, HC, LI, DT))
+        break;
+      forgetValue(V, mapChunk, mapDeg);
+      for(Value* Out : Outputs)
+        forgetValue(Out, mapChunk, mapDeg);
+      for(BasicBlock* BB : HC.Blocks){
+        for(Instruction &I : *BB)
+          forgetValue(&I, mapChunk, mapDeg);
+        forgetValue(BB, mapChunk, mapDeg);
+      }
+      NumHoisted++;
+      NumHoistedChunks++;
+      NumDirectHoists++;
+    }
+    return NumHoisted;
+  }/*}-}*/
+
+  /// The loop whose body holds the command V: the parent of an inner loop
+  /// for its header, the loop of the block otherwise./*{-{*/
+  static Loop* getCommandLoop(Value* V, LoopInfo* LI){
+    if(BasicBlock* BB = dyn_cast<BasicBlock>(V)){
+      Loop* Inner = LI->getLoopFor(BB);
+      if(Inner && Inner->getHeader() == BB)
+        return Inner->getParentLoop();
+      return Inner;
+    }
+    if(Instruction* I = dyn_cast<Instruction>(V))
+      return LI->getLoopFor(I->getParent());
+    return nullptr;
+  }/*}-}*/
+
+  /// Collect the values defined outside M the command V reads, through the
+  /// pure instructions of M. Return false if V reads a phi of M or the
+  /// memory, its value may then change with the iterations of M./*{-{*/
+  static bool getExternalInputs(Value* V, Loop* M, LoopInfo* LI,
+                                MapChunk* mapChunk,
+                                SmallPtrSetImpl<Value*> &Inputs){
+    BSet Blocks;
+    SmallVector<Value*, 16> WorkList;
+    if(BasicBlock* BB = dyn_cast<BasicBlock>(V)){
+      Loop* Inner = LI->getLoopFor(BB);
+      if(!Inner)
+        return false;
+      Blocks.insert(Inner->block_begin(), Inner->block_end());
+    } else if(TerminatorInst* TI = dyn_cast<TerminatorInst>(V)){
+      if(mapChunk->count(V) && (*mapChunk)[V]->getEnd())
+        getForkBlocks(TI->getParent(), (*mapChunk)[V]->getEnd(), &Blocks);
+      WorkList.append(TI->op_begin(), TI->op_end());
+    } else if(Instruction* I = dyn_cast<Instruction>(V))
+      WorkList.append(I->op_begin(), I->op_end());
+    for(BasicBlock* BB : Blocks)
+      for(Instruction &I : *BB)
+        WorkList.append(I.op_begin(), I.op_end());
+
+    SmallPtrSet<Value*, 16> Visited;
+    while(!WorkList.empty()){
+      Value* Op = WorkList.pop_back_val();
+      if(isa<Constant>(Op) || isa<BasicBlock>(Op) || !Visited.insert(Op).second)
+        continue;
+      Instruction* I = dyn_cast<Instruction>(Op);
+      if(!I || !M->contains(I->getParent())){
+        Inputs.insert(Op);
+        continue;
+      }
+      if(Blocks.count(I->getParent()))
+        continue;
+      if(isa<PHINode>(I) || I->mayReadFromMemory() || I->mayHaveSideEffects())
+        return false;
+      WorkList.append(I->op_begin(), I->op_end());
+    }
+    return true;
+  }/*}-}*/
+
+  // Degree of X in the body of L, 1 if it is defined before L/*{-{*/
+  static int getDegreeInLoop(Value* X, Loop* L, MapChunk* mapChunk){
+    Instruction* I = dyn_cast<Instruction>(X);
+    if(!I || !L->contains(I->getParent()))
+      return 1;
+    Value* head = dyn_cast<Value>(L->getHeader());
+    if(!mapChunk->count(head) || (*mapChunk)[head]->getType() == Chunk::ERROR)
+      return -1;
+    MapDeg* mapDeg = (*mapChunk)[head]->getMapDeg();
+    auto DD = mapDeg->find(X);
+    if(DD == mapDeg->end() || !DD->second)
+      return -1;
+    return DD->second;
+  }/*}-}*/
+
+  /// Compute the degree vector of each command of the loop nest of L. The
+  /// first entry is the degree of the command in its own loop, the next ones
+  /// in each parent loop up to L. A command is invariant in a parent loop
+  /// when it is in the child loop containing it and its inputs are invariant
+  /// in the parent. Once an entry is not 1 the next ones are unknown (-1)./*{-{*/
+  static void computeDegreeVectors(Loop* L, MapChunk* mapChunk, LoopInfo* LI,
+                                   MapDegVec* DegreeVectors){
+    // Only the nest of L is hoisted, the vectors of the previous loops and
+    // functions are dropped
+    DegreeVectors->clear();
+    SmallVector<Loop*, 8> Nest;
+    Nest.push_back(L);
+    for(unsigned i = 0; i < Nest.size(); ++i)
+      Nest.append(Nest[i]->begin(), Nest[i]->end());
+
+    for(Loop* Own : Nest){
+      Value* head = dyn_cast<Value>(Own->getHeader());
+      if(!mapChunk->count(head) ||
+         (*mapChunk)[head]->getType() == Chunk::ERROR)
+        continue;
+      MapDeg* mapDeg = (*mapChunk)[head]->getMapDeg();
+      for(auto DD = mapDeg->begin(), DDE = mapDeg->end(); DD != DDE; ++DD){
+        Value* V = DD->first;
+        if(getCommandLoop(V, LI) != Own)
+          continue;
+        DegVec &Vec = (*DegreeVectors)[V];
+        Vec.clear();
+        Vec.push_back(DD->second ? DD->second : -1);
+        for(Loop* Child = Own; Child != L; Child = Child->getParentLoop()){
+          Loop* Parent = Child->getParentLoop();
+          SmallPtrSet<Value*, 8> Inputs;
+          if(Vec.back() != 1 ||
+             !getExternalInputs(V, Child, LI, mapChunk, Inputs)){
+            Vec.push_back(-1);
+            continue;
+          }
+          int Deg = 1;
+          for(Value* X : Inputs){
+            int XDeg = getDegreeInLoop(X, Parent, mapChunk);
+            if(XDeg == -1){
+              Deg = -1;
+              break;
             }
-            else DEBUG(dbgs() << "ERROR: LOOP NOT REMOVED! \n");
+            Deg = std::max(Deg, XDeg);
           }
+          Vec.push_back(Deg);
         }
+        DEBUG(dbgs() << "Degree vector of " << V->getName() << " in " <<
+              Own->getHeader()->getName() << ":";
+              for(int D : Vec)
+                dbgs() << ' ' << D;
+              dbgs() << '\n');
       }
     }
+  }/*}-}*/
 
-    // Changer ça c'est moche ! FIXME
-    for (auto VV = BBToRemove.begin(), E = BBToRemove.end(); VV != E; ++VV) {
-      BasicBlock* BB = *VV;
-      for(BasicBlock::iterator LII = BB->begin(), LE = BB->end(); LII != LE;
-          ++LII){
-        Instruction &I = *LII;
-        toRemove.insert(&I);
-      }
-    }
-
-    // Changer ça c'est moche ! FIXME
-    ISet toRemoveOP;
-    for(Instruction* I : toRemove){
-      DEBUG(dbgs() <<"Removing OP from Instruction… "<< *I <<" \n");
-      Instruction *NewInst = cast<Instruction>(VMap[&*I]);
-      /* BB->dump(); */
-      DEBUG(dbgs() <<"ReplaceAllUses of" << *I << " With " << *NewInst <<"\n");
-      I->replaceAllUsesWith(NewInst); // With the last cloned value for I…
-      toRemoveOP.insert(I);
-      /* I->eraseFromParent(); */
-      for(auto OP = I->op_begin(), E = I->op_end(); OP!=E; ++OP){
-        DEBUG(dbgs() <<"ToRemove OP " << OP->get() <<"…\n");
-        if(OP->get() && isa<PHINode>(OP->get())){
-          Instruction* v = cast<Instruction>(OP->get());
-          // FIXME Not sure whe should to this here ↓
-          NewInst = cast<Instruction>(VMap[&*v]);
-          v->replaceAllUsesWith(NewInst); // With the last cloned value for I…
-          // ↑
-          toClean.insert(v);
-        }
+  /// Move the chunks of the nest of L (inner loops and forks) out of every
+  /// loop where their degree is 1, from their own loop up to L. The region is
+  /// checked again at each level. A level is left only if the chunk runs on
+  /// each iteration or can be speculated: pure forks and inner loops with a
+  /// computable trip count whose instructions are all safe to speculate.
+  /// Return the number of levels crossed./*{-{*/
+  static unsigned hoistAcrossNest(Loop* L, MapChunk* mapChunk,
+                                  MapDegVec* DegreeVectors, LoopInfo* LI,
+                                  ScalarEvolution* SE, DominatorTree* DT){
+    struct Candidate {
+      Value* V;
+      Loop* Own;
+      unsigned Depth;
+      unsigned Levels;
+    };
+    SmallVector<Candidate, 8> Candidates;
+    for(auto DV : *DegreeVectors){
+      Value* V = DV.first;
+      if(!isa<BasicBlock>(V) && !isa<TerminatorInst>(V))
+        continue;
+      Loop* Own = getCommandLoop(V, LI);
+      if(!Own || !L->contains(Own))
+        continue;
+      const DegVec &Vec = DV.second;
+      unsigned Levels = 0;
+      while(Levels < Vec.size() && Vec[Levels] == 1)
+        ++Levels;
+      // The chunks of a single level are the job of hoistInvariantChunks
+      if(Levels > 1)
+        Candidates.push_back({V, Own, Own->getLoopDepth(), Levels});
+    }
+    // Shallow chunks first, a chunk nested in a moved loop is left in it
+    std::stable_sort(Candidates.begin(), Candidates.end(),
+                     [](const Candidate &A, const Candidate &B){
+                       return A.Depth < B.Depth;
+                     });
+
+    unsigned NumLevels = 0;
+    for(Candidate &C : Candidates){
+      if(getCommandLoop(C.V, LI) != C.Own || C.Own->getLoopDepth() != C.Depth)
+        continue;
+      HoistableChunk HC;
+      if(!getChunkRegion(C.V, C.Own, mapChunk, LI, HC))
+        continue;
+      bool Speculate = !HC.Inner ||
+        !isa<SCEVCouldNotCompute>(SE->getBackedgeTakenCount(HC.Inner));
+      Loop* Cur = C.Own;
+      SE->forgetLoop(L);
+      for(unsigned Level = 0; Level < C.Levels; ++Level){
+        Loop* Parent = Cur->getParentLoop();
+        Value* head = dyn_cast<Value>(Cur->getHeader());
+        if(!Cur->getLoopPreheader() || !mapChunk->count(head) ||
+           !isHoistableRegion(Cur, HC, DT, Speculate))
+          break;
+        DEBUG(dbgs() << "Hoisting the chunk of " << HC.Src->getName() <<
+              " out of " << Cur->getHeader()->getName() << '\n');
+        MapDeg* mapDeg = (*mapChunk)[head]->getMapDeg();
+        std::vector<Value*> Outputs;
+        for(BasicBlock::iterator I = HC.End->begin(); isa<PHINode>(I); ++I)
+          Outputs.push_back(&*I);
+        if(!hoistChunk(Cur, HC, LI, DT))
+          break;
+        for(Value* Out : Outputs)
+          forgetValue(Out, mapChunk, mapDeg);
+        for(BasicBlock* BB : HC.Blocks)
+          for(Instruction &I : *BB)
+            mapDeg->erase(&I);
+        mapDeg->erase(C.V);
+        NumLevels++;
+        if(Cur == L)
+          break;
+        Cur = Parent;
+      }
+      if(Cur != C.Own){
+        NumHoistedChunks++;
+        NumNestHoists++;
       }
     }
+    return NumLevels;
+  }/*}-}*/
 
-    DEBUG(dbgs() <<"Removing OP…\n");
-    for (auto VV = toRemoveOP.begin(), E = toRemoveOP.end(); VV != E; ++VV) {
-      Instruction* V = *VV;
-      DEBUG(dbgs() <<"Removing " << *V <<"…\n");
-      V->eraseFromParent();
-      DEBUG(dbgs() <<"Removed!\n");
-    }
-    for (auto VV = BBToRemove.begin(), E = BBToRemove.end(); VV != E; ++VV) {
-      BasicBlock* BB = *VV;
-      DEBUG(dbgs() <<"Removing " << *BB <<"…\n");
-      /* Loop* LL = LI->getLoopFor(BB); */
-      /* LL->removeBlockFromLoop(BB); */
+  /// Collect in Inputs the values of L read by the pure chunk HC of the
+  /// command V: the inputs of its relation completed by the operands of its
+  /// blocks. Return false if one of them cannot be compared at the source of
+  /// the chunk./*{-{*/
+  static bool getMemoInputs(Value* V, Loop* L, MapChunk* mapChunk,
+                            DominatorTree* DT, HoistableChunk &HC,
+                            SmallSetVector<Value*, 4> &Inputs){
+    TerminatorInst* SrcTI = HC.Src->getTerminator();
+    auto AddInput = [&](Value* X){
+      Instruction* I = dyn_cast<Instruction>(X);
+      // Values of the chunk or of the previous loops never change
+      if(!I || !L->contains(I->getParent()) || HC.Blocks.count(I->getParent()))
+        return true;
+      Type* Ty = I->getType();
+      if(!Ty->isIntegerTy() && !Ty->isPointerTy() && !Ty->isFloatingPointTy())
+        return false;
+      if(!DT->dominates(I, SrcTI))
+        return false;
+      Inputs.insert(I);
+      return true;
+    };
+    if(Relation* R = (*mapChunk)[V]->getRel())
+      for(Value* X : R->getIn()){
+        // The outputs also appear in the relation
+        Instruction* I = dyn_cast<Instruction>(X);
+        if(I && I->getParent() == HC.End && isa<PHINode>(I))
+          continue;
+        if(!isa<BasicBlock>(X) && !AddInput(X))
+          return false;
+      }
+    unsigned NumRelInputs = Inputs.size();
+    if(!isPureRegion(L, HC, DT, false, AddInput))
+      return false;
+    DEBUG(if(Inputs.size() != NumRelInputs)
+            dbgs() << "Memo: " << Inputs.size() - NumRelInputs <<
+              " inputs missing in the relation of " << V->getName() << '\n');
+    return true;
+  }/*}-}*/
+
+  /// Skip the pure chunk HC of L when its inputs are the ones of its last run.
+  /// The last inputs and outputs are kept in header phis, a flag tells if the
+  /// chunk already ran:
+  ///   Src:      hit = valid && inputs == last inputs
+  ///             br hit, End.memo, Src.memo.miss
+  ///   Src.memo.miss: the chunk
+  ///   End:      the outputs
+  ///   End.memo: outputs = phi [End outputs, End], [last outputs, Src]
+  /// Return true if the chunk is memoized./*{-{*/
+  static bool memoizeChunk(Loop* L, HoistableChunk &HC,
+                           ArrayRef<Value*> Inputs, LoopInfo* LI,
+                           DominatorTree* DT){
+    BasicBlock* Header = L->getHeader();
+    BasicBlock* Preheader = L->getLoopPreheader();
+    if(!Preheader)
+      return false;
+    for(BasicBlock::iterator I = HC.End->begin(); isa<PHINode>(I); ++I)
+      if(I->getType()->isTokenTy())
+        return false;
+
+    // The chunk runs in its own block, the end keeps only its phis so an
+    // inner loop keeps a dedicated exit
+    BasicBlock* Src = HC.Src;
+    BasicBlock* Miss = SplitBlock(Src, Src->getTerminator(), DT, LI);
+    Miss->setName(Src->getName() + ".memo.miss");
+    BasicBlock* Merge = SplitBlock(HC.End, HC.End->getFirstNonPHI(), DT, LI);
+    Merge->setName(HC.End->getName() + ".memo");
+    // The end may have been the latch
+    BasicBlock* Latch = L->getLoopLatch();
+    LLVMContext &Ctx = Header->getContext();
+    Instruction* HeaderPt = &Header->front();
+
+    PHINode* Valid = PHINode::Create(Type::getInt1Ty(Ctx), 2, "memo.valid",
+                                     HeaderPt);
+    Valid->addIncoming(ConstantInt::getFalse(Ctx), Preheader);
+    Valid->addIncoming(ConstantInt::getTrue(Ctx), Latch);
+
+    IRBuilder<> Builder(Src->getTerminator());
+    Value* Same = ConstantInt::getTrue(Ctx);
+    for(Value* X : Inputs){
+      PHINode* Last = PHINode::Create(X->getType(), 2, X->getName() + ".memo",
+                                      HeaderPt);
+      Last->addIncoming(UndefValue::get(X->getType()), Preheader);
+      Last->addIncoming(X, Latch);
+      Value* New = X;
+      Value* Old = Last;
+      // Compare the bits: -0.0 == 0.0 and NaN != NaN
+      if(X->getType()->isFloatingPointTy()){
+        Type* IntTy = Builder.getIntNTy(X->getType()->getPrimitiveSizeInBits());
+        New = Builder.CreateBitCast(New, IntTy);
+        Old = Builder.CreateBitCast(Old, IntTy);
+      }
+      Same = Builder.CreateAnd(Same, Builder.CreateICmpEQ(New, Old));
+    }
+    // The last inputs are undef before the first run
+    Value* Hit = Builder.CreateSelect(Valid, Same, ConstantInt::getFalse(Ctx),
+                                      "memo.hit");
+
+    Instruction* MergePt = &Merge->front();
+    for(BasicBlock::iterator I = HC.End->begin(); isa<PHINode>(I); ++I){
+      PHINode* Out = cast<PHINode>(&*I);
+      PHINode* Last = PHINode::Create(Out->getType(), 2,
+                                      Out->getName() + ".memo", HeaderPt);
+      PHINode* Res = PHINode::Create(Out->getType(), 2,
+                                     Out->getName() + ".memo.res", MergePt);
+      Out->replaceAllUsesWith(Res);
+      Res->addIncoming(Out, HC.End);
+      Res->addIncoming(Last, Src);
+      Last->addIncoming(UndefValue::get(Out->getType()), Preheader);
+      Last->addIncoming(Res, Latch);
+    }
+
+    Src->getTerminator()->eraseFromParent();
+    BranchInst::Create(Merge, Miss, Hit, Src);
+    DT->changeImmediateDominator(Merge, Src);
+    HC.Src = Miss;
+    HC.End = Merge;
+    return true;
+  }/*}-}*/
+
+  /// Memoize the chunks of L whose degree is infinite, inner loops or forks
+  /// without side effect, when they cost more than MinCost and read at most
+  /// MaxInputs values of L. Return the number of chunks memoized./*{-{*/
+  static unsigned memoizeChunks(Loop* L, MapChunk* mapChunk,
+                                std::vector<Value*> *OC, LoopInfo* LI,
+                                DominatorTree* DT, ScalarEvolution* SE,
+                                const TargetTransformInfo* TTI,
+                                unsigned MinCost, unsigned MaxInputs){
+    Value* head = dyn_cast<Value>(L->getHeader());
+    MapDeg *mapDeg = (*mapChunk)[head]->getMapDeg();
+    BSet Memoized;
+    unsigned NumMemoized = 0;
+    for(Value* V : *OC){
+      auto DD = mapDeg->find(V);
+      if(DD == mapDeg->end() || DD->second != -1)
+        continue;
+      HoistableChunk HC;
+      SmallSetVector<Value*, 4> Inputs;
+      if(!getChunkRegion(V, L, mapChunk, LI, HC) || Memoized.count(HC.Src) ||
+         !getMemoInputs(V, L, mapChunk, DT, HC, Inputs) ||
+         Inputs.size() > MaxInputs)
+        continue;
+      // The chunks nested in a memoized one are left
+      bool Nested = false;
+      for(BasicBlock* BB : HC.Blocks)
+        Nested |= Memoized.count(BB);
+      unsigned Cost = getChunkCost(V, L, mapChunk, LI, SE, TTI, 1);
+      if(Nested || Cost < MinCost)
+        continue;
+      DEBUG(dbgs() << "Memoizing the chunk of " << HC.Src->getName() <<
+            " to " << HC.End->getName() << " on " << Inputs.size() <<
+            " inputs, cost " << Cost << '\n');
+      SE->forgetLoop(L);
+      Memoized.insert(HC.Blocks.begin(), HC.Blocks.end());
+      Memoized.insert(HC.Src);
+      Memoized.insert(HC.End);
+      if(!memoizeChunk(L, HC, Inputs.getArrayRef(), LI, DT))
+        continue;
+      Memoized.insert(HC.Src);
+      Memoized.insert(HC.End);
+      NumMemoized++;
+      NumMemoizedChunks++;
+    }
+    return NumMemoized;
+  }/*}-}*/
+
+  // Remove chuncks with deg == curDeg (except if < 0) of the remaining body,/*{-{*/
+  // VMap gives their value in the last peeled iteration.
+  // Return the number of commands removed.
+  unsigned updateLoopBody(Loop* L, int curDeg, MapChunk* mapChunk,
+                          ValueToValueMapTy &VMap, ScalarEvolution *SE,
+                          DominatorTree *DT, LoopInfo *LI,
+                          std::vector<Value*> *OC){
+    DEBUG(dbgs() <<"CurDeg = " << curDeg << " :\n");
+
+    // If we are here, it works
+    Value* head = dyn_cast<Value>(L->getHeader());
+
+    Chunk* currentChunk = (*mapChunk)[head];
+    MapDeg *mapDeg = currentChunk->getMapDeg();
+
+    std::vector<Loop*> LoopToRemove;
+    std::vector<Instruction*> InstToRemove;
+    std::vector<TerminatorInst*> ForkToRemove;
+    BSet BBToRemove;
+
+    // Reuse the ordered commands which have a degree computed
+    for(Value* V : *OC){
+      auto DD = mapDeg->find(V);
+      if(DD == mapDeg->end() || DD->second != curDeg)
+        continue;
+      if(!isRemovableAfterPeel(V, L, mapChunk, mapDeg, DT, LI)){
+        DEBUG(dbgs() << "Not removable: " << *V << '\n');
+        continue;
+      }
+      if(BasicBlock* BB = dyn_cast<BasicBlock>(V))
+        LoopToRemove.push_back(LI->getLoopFor(BB));
+      else if(TerminatorInst* TInst = dyn_cast<TerminatorInst>(V))
+        ForkToRemove.push_back(TInst);
+      else
+        InstToRemove.push_back(cast<Instruction>(V));
+    }
+
+    // Instructions take the value of their clone in the last iteration
+    unsigned NumRemoved = 0;
+    for(Instruction* I : InstToRemove){
+      Value* NewV = VMap.lookup(I);
+      if(!NewV)
+        continue;
+      DEBUG(dbgs() <<"ReplaceAllUses of" << *I << " With " << *NewV <<"\n");
+      I->replaceAllUsesWith(NewV);
+      forgetValue(I, mapChunk, mapDeg);
+      I->eraseFromParent();
+      NumRemoved++;
+      NumHoistedInsts++;
+    }
+
+    // The branches of a fork are removed, the phis of its end are the outputs
+    for(TerminatorInst* TInst : ForkToRemove){
+      Chunk* forkChunk = (*mapChunk)[TInst];
+      BasicBlock *IfEnd = forkChunk->getEnd();
+      DEBUG(dbgs() <<"Start of a registered branch we need to hoist " << *TInst
+            << "\n");
+      for(BasicBlock::iterator PII = IfEnd->begin(); isa<PHINode>(PII);){
+        PHINode* PI = cast<PHINode>(&*PII++);
+        PI->replaceAllUsesWith(VMap.lookup(PI));
+        forgetValue(PI, mapChunk, mapDeg);
+        PI->eraseFromParent();
+      }
+      BasicBlock *Start = TInst->getParent();
+      BSet ForkBlocks;
+      getForkBlocks(Start, IfEnd, &ForkBlocks);
+      BBToRemove.insert(ForkBlocks.begin(), ForkBlocks.end());
+      forgetValue(TInst, mapChunk, mapDeg);
+      // Modify the TInst to go directly to the if.end…
+      ReplaceInstWithInst(TInst, BranchInst::Create(IfEnd));
+      // …which is now dominated by the start of the fork
+      eraseFromDomTree(ForkBlocks, Start, *DT);
+      NumRemoved++;
+      NumHoistedChunks++;
+      // Don't care about merging IfEnd, other passes like simplifycfg will do it
+    }
+
+    // Inner loops are removed, their LCSSA phis are the outputs
+    std::vector<Loop*> LoopRemoved;
+    for(Loop* Inner : LoopToRemove){
+      BasicBlock* Exit = Inner->getUniqueExitBlock();
+      for(BasicBlock::iterator PII = Exit->begin(); isa<PHINode>(PII);){
+        PHINode* PI = cast<PHINode>(&*PII++);
+        PI->replaceAllUsesWith(VMap.lookup(PI));
+        forgetValue(PI, mapChunk, mapDeg);
+        PI->eraseFromParent();
+      }
+      forgetValue(Inner->getHeader(), mapChunk, mapDeg);
+      if(deleteLoop(Inner, *DT, *SE, *LI, &BBToRemove)){
+        DEBUG(dbgs() << " LOOP REMOVED! \n");
+        LoopRemoved.push_back(Inner);
+        NumRemoved++;
+        NumHoistedChunks++;
+      }
+      else DEBUG(dbgs() << "ERROR: LOOP NOT REMOVED! \n");
+    }
+
+    // Blocks leave the loop nest before being erased
+    for(BasicBlock* BB : BBToRemove)
+      LI->removeBlock(BB);
+    for(Loop* Inner : LoopRemoved)
+      LI->markAsRemoved(Inner);
+    for(BasicBlock* BB : BBToRemove){
+      for(Instruction &I : *BB)
+        forgetValue(&I, mapChunk, mapDeg);
+      forgetValue(BB, mapChunk, mapDeg);
+      BB->dropAllReferences();
+    }
+    for(BasicBlock* BB : BBToRemove){
+      DEBUG(dbgs() <<"Removing " << BB->getName() <<"…\n");
       BB->eraseFromParent();
-      DEBUG(dbgs() <<"Removed!\n");
     }
 
-    // FIXME maybe we should do this at the end ^^'
-    // The last step is to update LoopInfo now that we've eliminated this loop.
-    for(Loop* LL : LoopToRemove){
-      DEBUG(dbgs() <<"Removing " << *LL <<"…\n");
-      SmallPtrSet<BasicBlock *, 8> blocks;
-      blocks.insert(LL->block_begin(), LL->block_end());
-      for (BasicBlock *BB : blocks){
-        LI->removeBlock(BB);
+    return NumRemoved;
+  }/*}-}*/
+
+  /// Register NewBB, the clone of OrigBB in a peeled iteration of L, in the/*{-{*/
+  /// loop nest. The inner loops of L are cloned as new loops of the parent.
+  static void addClonedBlockToLoopInfo(BasicBlock *OrigBB, BasicBlock *NewBB,
+                                       Loop *L, LoopInfo *LI,
+                                       DenseMap<Loop*, Loop*> &NewLoops){
+    Loop *OldLoop = LI->getLoopFor(OrigBB);
+    Loop *NewLoop = L->getParentLoop();
+    if(OldLoop != L){
+      NewLoop = NewLoops.lookup(OldLoop);
+      if(!NewLoop){
+        // The header comes first in RPO, the loop is created with it
+        NewLoop = new Loop();
+        NewLoops[OldLoop] = NewLoop;
+        Loop *NewParent = OldLoop->getParentLoop() == L ? L->getParentLoop() :
+          NewLoops.lookup(OldLoop->getParentLoop());
+        if(NewParent)
+          NewParent->addChildLoop(NewLoop);
+        else
+          LI->addTopLevelLoop(NewLoop);
       }
-      LI->markAsRemoved(LL);
-      DEBUG(dbgs() <<"Removed!\n");
     }
-
-    return toClean;
+    if(NewLoop)
+      NewLoop->addBasicBlockToLoop(NewBB, *LI);
   }/*}-}*/
 
   /// \brief Clones the body of the loop L, putting it between \p InsertTop and \p
@@ -1701,29 +3160,38 @@ namespace llvm {
                               BasicBlock *InsertBot, BasicBlock *Exit,
                               SmallVectorImpl<BasicBlock *> &NewBlocks,
                               LoopBlocksDFS &LoopBlocks, ValueToValueMapTy &VMap,
-                              ValueToValueMapTy &LVMap, LoopInfo *LI) {
+                              ValueToValueMapTy &LVMap, LoopInfo *LI,
+                              DominatorTree *DT) {
 
     BasicBlock *Header = L->getHeader();
     BasicBlock *Latch = L->getLoopLatch();
+    BasicBlock *Exiting = L->getExitingBlock();
     BasicBlock *PreHeader = L->getLoopPreheader();
 
     Function *F = Header->getParent();
     LoopBlocksDFS::RPOIterator BlockBegin = LoopBlocks.beginRPO();
     LoopBlocksDFS::RPOIterator BlockEnd = LoopBlocks.endRPO();
-    Loop *ParentLoop = L->getParentLoop();
+    DenseMap<Loop*, Loop*> NewLoops;
 
     // For each block in the original loop, create a new copy,
     // and update the value map with the newly created values.
     for (LoopBlocksDFS::RPOIterator BB = BlockBegin; BB != BlockEnd; ++BB) {
-      DEBUG(dbgs() << "cloning BB : " <<"\n");
-      (*BB)->dump();
+      DEBUG(dbgs() << "cloning BB : " << (*BB)->getName() <<"\n");
       BasicBlock *NewBB = CloneBasicBlock(*BB, VMap, ".peel", F);
       NewBlocks.push_back(NewBB);
 
-      if (ParentLoop)
-        ParentLoop->addBasicBlockToLoop(NewBB, *LI);
+      addClonedBlockToLoopInfo(*BB, NewBB, L, LI, NewLoops);
 
       VMap[*BB] = NewBB;
+
+      // The clone of the header is dominated by the top, the other clones by
+      // the clone of their dominator, already done in RPO
+      if (*BB == Header)
+        DT->addNewBlock(NewBB, InsertTop);
+      else {
+        BasicBlock *IDom = DT->getNode(*BB)->getIDom()->getBlock();
+        DT->addNewBlock(NewBB, cast<BasicBlock>(VMap[IDom]));
+      }
     }
 
     // Hook-up the control flow for the newly inserted blocks.
@@ -1747,6 +3215,12 @@ namespace llvm {
     if((1 - HeaderIdx) < LatchBR->getNumSuccessors())
       LatchBR->setSuccessor(1 - HeaderIdx, Exit);
     DEBUG(dbgs() <<"LatchBR = " << *LatchBR << "\n");
+    // The bottom is only reached from the cloned latch and the exit is also
+    // reached from the cloned exiting block
+    DT->changeImmediateDominator(InsertBot, cast<BasicBlock>(VMap[Latch]));
+    BasicBlock *ExitIDom = DT->getNode(Exit)->getIDom()->getBlock();
+    DT->changeImmediateDominator(Exit, DT->findNearestCommonDominator(
+        ExitIDom, cast<BasicBlock>(VMap[Exiting])));
     //FIXME ERROR here why?
     /* LatchBR->setSuccessor(1 - HeaderIdx, Exit); */
 
@@ -1778,20 +3252,17 @@ namespace llvm {
     // we've just created. Note that this must happen *after* the incoming
     // values are adjusted, since the value going out of the latch may also be
     // a value coming into the header.
-    DEBUG(dbgs() <<" Feeding VMap for the outgoing values " << *Latch << "\n");
+    // Our loops exit in the header (not rotated), then the outgoing values
+    // come from the exiting block which is not always the latch.
+    DEBUG(dbgs() <<" Feeding VMap for the outgoing values " << *Exiting << "\n");
     for (BasicBlock::iterator I = Exit->begin(); isa<PHINode>(I); ++I) {
       PHINode *PHI = cast<PHINode>(I);
       DEBUG(dbgs() <<" On PHI " << *PHI << "\n");
-      // Here we made a correction… maybe the loop's form is not appropriate…
-      DEBUG(dbgs() <<"WARN: Index of Latch = " << PHI->getBasicBlockIndex(Latch)
-            << "\n");
-      if(PHI->getBasicBlockIndex(Latch) != -1){
-        Value *LatchVal = PHI->getIncomingValueForBlock(Latch);
-        Instruction *LatchInst = dyn_cast<Instruction>(LatchVal);
-        if (LatchInst && L->contains(LatchInst))
-          LatchVal = VMap[LatchVal];
-        PHI->addIncoming(LatchVal, cast<BasicBlock>(VMap[Latch]));
-      }
+      Value *ExitVal = PHI->getIncomingValueForBlock(Exiting);
+      Instruction *ExitInst = dyn_cast<Instruction>(ExitVal);
+      if (ExitInst && L->contains(ExitInst))
+        ExitVal = VMap[ExitVal];
+      PHI->addIncoming(ExitVal, cast<BasicBlock>(VMap[Exiting]));
     }
     DEBUG(dbgs() <<" ok !\n");
 
@@ -1809,14 +3280,15 @@ namespace llvm {
   /// For loops that dynamically execute \p PeelCount iterations or less
   /// this provides a benefit, since the peeled off iterations, which account
   /// for the bulk of dynamic execution, can be further simplified by scalar
-  /// optimizations./*{-{*/
+  /// optimizations.
+  /// The commands of degree lower or equal to \p PeelCount are then removed
+  /// from the remaining body, the loop stays in LCSSA and simplified form./*{-{*/
   bool mypeelLoop(Loop *L, unsigned PeelCount, MapChunk*
                   mapChunk,std::vector<Value*> *OC, LoopInfo *LI,
-                  ScalarEvolution *SE, DominatorTree *DT, PostDominatorTree
-                  *PDT, bool PreserveLCSSA) {
+                  ScalarEvolution *SE, DominatorTree *DT, bool PreserveLCSSA) {
 
     DEBUG(dbgs() <<"**************in mypeelLoop !****************\n");
-    L->print(dbgs());
+    DEBUG(L->print(dbgs()));
     DEBUG(dbgs() <<"Loop Before peeling ↑ \n");
     if (!canPeel(L))
       return false;
@@ -1825,7 +3297,9 @@ namespace llvm {
     Value* head = dyn_cast<Value>(L->getHeader());
 
     Chunk* currentChunk = (*mapChunk)[head];
-    MapDeg *mapDeg = currentChunk->getMapDeg();
+
+    // The trip count of the loop will change
+    SE->forgetLoop(L);
 
     LoopBlocksDFS LoopBlocks(L);
     LoopBlocks.perform(LI);
@@ -1917,7 +3391,7 @@ namespace llvm {
       BackEdgeWeight = HeaderIdx ? FalseWeight : TrueWeight;
     }
 
-    VSet toClean;
+    unsigned NumRemoved = 0;
     ValueToValueMapTy VMap;
     // For each peeled-off iteration, make a copy of the loop.
     for (unsigned Iter = 0; Iter < PeelCount; ++Iter) {
@@ -1934,7 +3408,7 @@ namespace llvm {
         BackEdgeWeight = 1;
 
       cloneLoopBlocks(L, Iter, InsertTop, InsertBot, Exit,
-                      NewBlocks, LoopBlocks, VMap, LVMap, LI);
+                      NewBlocks, LoopBlocks, VMap, LVMap, LI, DT);
       updateBranchWeights(InsertBot, cast<BranchInst>(VMap[LatchBR]), Iter,
                           PeelCount, ExitWeight);
 
@@ -1950,26 +3424,15 @@ namespace llvm {
       // previous one.
       remapInstructionsInBlocks(NewBlocks, VMap);
 
-      // TODO
-      //Remove chunck/inst with a deg <= Iter (except -1 which is infinity)
-      toClean = mergeVSet(toClean, updateLoopBody(L, Iter+1, mapChunk, VMap, SE,
-                                                  DT, PDT, LI, OC));
+      //Remove chunck/inst with a deg == Iter+1 (except -1 which is infinity)
+      NumRemoved += updateLoopBody(L, Iter+1, mapChunk, VMap, SE, DT, LI, OC);
 
       LoopBlocks.clear();
       LoopBlocks.perform(LI);
 
-      L->print(dbgs());
-    }
-
-    DEBUG(dbgs() <<"Cleaning Phi!…\n");
-    for (auto VV = toClean.begin(), E = toClean.end(); VV != E; ++VV) {
-      Value* V = *VV;
-      if(Instruction* I = dyn_cast<Instruction>(V)){
-        DEBUG(dbgs() <<"Removing " << *V <<"…\n");
-        I->eraseFromParent();
-        DEBUG(dbgs() <<"Removed!\n");
-      }
+      DEBUG(L->print(dbgs()));
     }
+    DEBUG(dbgs() << NumRemoved << " commands removed from the body\n");
 
     // Now adjust the phi nodes in the loop header to get their initial values
     // from the last peeled-off iteration instead of the preheader.
@@ -1995,11 +3458,524 @@ namespace llvm {
     }
 
     // If the loop is nested, we changed the parent loop, update SE.
+    Loop *OuterLoop = L;
+    if (Loop *ParentLoop = L->getParentLoop()){
+      SE->forgetLoop(ParentLoop);
+      OuterLoop = ParentLoop;
+    }
+
+    // The exit block is now shared with the peeled iterations, get back
+    // dedicated exits and the LCSSA form of the loop nest.
+    simplifyLoop(L, DT, LI, SE, nullptr, PreserveLCSSA);
+    if (PreserveLCSSA)
+      formLCSSARecursively(*OuterLoop, *DT, LI, SE);
+
+#ifndef NDEBUG
+    assert(!verifyFunction(*F, &dbgs()) && "Peeling broke the function");
+    DT->verifyDomTree();
+    assert(L->isLoopSimplifyForm() && "Peeled loop not simplified");
+    assert((!PreserveLCSSA || OuterLoop->isRecursivelyLCSSAForm(*DT)) &&
+           "Peeled loop not in LCSSA form");
+#endif
+
+    NumPeeledLoops++;
+    return true;
+  }/*}-}*/
+
+  /// Split the iteration space of L instead of peeling it: a prologue loop,
+  /// clone of L, runs the first \p Deg iterations and leaves to L, which runs
+  /// the other ones without the chunks of degree at most Deg. These take the
+  /// values of the last iteration of the prologue through phis of the new
+  /// preheader. The body is cloned once, whatever the degree.
+  ///
+  /// PreHeader:                      PreHeader:
+  /// Header:                         Header.split.ph:
+  ///   If (!cond) goto Exit          Header.split:   (count = 0, 1, …)
+  ///   LoopBody                        If (!cond) goto Exit
+  ///   goto Header            →        LoopBody
+  /// Exit:                             If (++count < Deg) goto Header.split
+  ///                                 Header.ph: (last values of the prologue)
+  ///                                 Header:
+  ///                                   If (!cond) goto Exit
+  ///                                   LoopBody without the chunks
+  ///                                   goto Header
+  ///                                 Exit:/*{-{*/
+  bool splitLoop(Loop *L, unsigned Deg, MapChunk* mapChunk,
+                 std::vector<Value*> *OC, LoopInfo *LI, ScalarEvolution *SE,
+                 DominatorTree *DT, bool PreserveLCSSA) {
+    DEBUG(dbgs() <<"**************in splitLoop !****************\n");
+    if (!canPeel(L))
+      return false;
+
+    BasicBlock *Header = L->getHeader();
+    BasicBlock *PreHeader = L->getLoopPreheader();
+    BasicBlock *Latch = L->getLoopLatch();
+    BasicBlock *Exit = L->getUniqueExitBlock();
+    // The prologue leaves on its latch, it must not be an exit already
+    if (L->getExitingBlock() != Header ||
+        Latch->getTerminator()->getNumSuccessors() != 1)
+      return false;
+
+    Value* head = dyn_cast<Value>(Header);
+    Chunk* currentChunk = (*mapChunk)[head];
+    MapDeg *mapDeg = currentChunk->getMapDeg();
+    Function *F = Header->getParent();
+    LLVMContext &Ctx = F->getContext();
+
+    // The commands removed from the main loop, before the CFG changes
+    std::vector<Value*> Removed;
+    for(Value* V : *OC){
+      auto DD = mapDeg->find(V);
+      if(DD != mapDeg->end() && DD->second <= (int)Deg &&
+         isRemovableAfterPeel(V, L, mapChunk, mapDeg, DT, LI))
+        Removed.push_back(V);
+    }
+
+    // The trip count of the loop will change
+    SE->forgetLoop(L);
+
+    // The prologue is a clone of the loop with its own preheader
+    BasicBlock *NewPreHeader = SplitEdge(PreHeader, Header, DT, LI);
+    NewPreHeader->setName(Header->getName() + ".ph");
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock *, 8> NewBlocks;
+    Loop *Prologue = cloneLoopWithPreheader(NewPreHeader, PreHeader, L, VMap,
+                                            ".split", LI, DT, NewBlocks);
+    remapInstructionsInBlocks(NewBlocks, VMap);
+    BasicBlock *ProloguePH = cast<BasicBlock>(VMap[NewPreHeader]);
+    BasicBlock *PrologueHeader = cast<BasicBlock>(VMap[Header]);
+    BasicBlock *PrologueLatch = cast<BasicBlock>(VMap[Latch]);
+    PreHeader->getTerminator()->replaceUsesOfWith(NewPreHeader, ProloguePH);
+
+    // The prologue counts its iterations and leaves to the main loop after Deg
+    IntegerType *CountTy = Type::getInt32Ty(Ctx);
+    PHINode *Count = PHINode::Create(CountTy, 2, "lqicm.split.count",
+                                     &PrologueHeader->front());
+    Count->addIncoming(ConstantInt::get(CountTy, 0), ProloguePH);
+    TerminatorInst *PrologueBR = PrologueLatch->getTerminator();
+    Value *Next = BinaryOperator::CreateNUWAdd(Count,
+                                               ConstantInt::get(CountTy, 1),
+                                               "lqicm.split.next", PrologueBR);
+    Count->addIncoming(Next, PrologueLatch);
+    Value *Again = new ICmpInst(PrologueBR, ICmpInst::ICMP_ULT, Next,
+                                ConstantInt::get(CountTy, Deg),
+                                "lqicm.split.again");
+    ReplaceInstWithInst(PrologueBR,
+                        BranchInst::Create(PrologueHeader, NewPreHeader, Again));
+
+    // The prologue also leaves to the exit when the loop is short
+    for (BasicBlock::iterator I = Exit->begin(); isa<PHINode>(I); ++I) {
+      PHINode *PHI = cast<PHINode>(I);
+      Value *V = PHI->getIncomingValueForBlock(Header);
+      Value *NewV = VMap.lookup(V);
+      PHI->addIncoming(NewV ? NewV : V, PrologueHeader);
+    }
+
+    // Value of V at the end of the last iteration of the prologue
+    auto getLastValue = [&](Value *V) -> Value* {
+      Value *NewV = VMap.lookup(V);
+      if (!NewV)
+        return V;
+      PHINode *PN = PHINode::Create(V->getType(), 1, V->getName() + ".last",
+                                    &NewPreHeader->front());
+      PN->addIncoming(NewV, PrologueLatch);
+      return PN;
+    };
+
+    // The main loop starts where the prologue stops
+    for (BasicBlock::iterator I = Header->begin(); isa<PHINode>(I); ++I) {
+      PHINode *PHI = cast<PHINode>(I);
+      Value *NewVal = getLastValue(PHI->getIncomingValueForBlock(Latch));
+      PHI->setIncomingValue(PHI->getBasicBlockIndex(NewPreHeader), NewVal);
+    }
+
+    // The removed commands take their last value in the prologue, the outputs
+    // of the inner loops and forks are the phis of their ends
+    ValueToValueMapTy LVMap;
+    for(Value* V : Removed){
+      BasicBlock *OutBB = nullptr;
+      if(BasicBlock* InnerHead = dyn_cast<BasicBlock>(V))
+        OutBB = LI->getLoopFor(InnerHead)->getUniqueExitBlock();
+      else if(isa<TerminatorInst>(V))
+        OutBB = (*mapChunk)[V]->getEnd();
+      else
+        LVMap[V] = getLastValue(V);
+      if(OutBB)
+        for(BasicBlock::iterator I = OutBB->begin(); isa<PHINode>(I); ++I)
+          LVMap[&*I] = getLastValue(&*I);
+    }
+
+    // The main loop is entered from the prologue, the exit is also reached
+    // from the prologue
+    DT->changeImmediateDominator(NewPreHeader, PrologueLatch);
+    BasicBlock *ExitIDom = DT->getNode(Exit)->getIDom()->getBlock();
+    DT->changeImmediateDominator(Exit, DT->findNearestCommonDominator(
+        ExitIDom, PrologueHeader));
+
+    unsigned NumRemoved = 0;
+    for (unsigned CurDeg = 1; CurDeg <= Deg; ++CurDeg)
+      NumRemoved += updateLoopBody(L, CurDeg, mapChunk, LVMap, SE, DT, LI, OC);
+    DEBUG(dbgs() << NumRemoved << " commands removed from the body\n");
+    currentChunk->setPeeled(true);
+
+    // If the loop is nested, we changed the parent loop, update SE.
+    Loop *OuterLoop = L;
+    if (Loop *ParentLoop = L->getParentLoop()){
+      SE->forgetLoop(ParentLoop);
+      OuterLoop = ParentLoop;
+    }
+
+    // The exit block is shared by the two loops, get back dedicated exits and
+    // the LCSSA form of the loop nest.
+    simplifyLoop(L, DT, LI, SE, nullptr, PreserveLCSSA);
+    simplifyLoop(Prologue, DT, LI, SE, nullptr, PreserveLCSSA);
+    if (PreserveLCSSA) {
+      formLCSSARecursively(*OuterLoop, *DT, LI, SE);
+      if (OuterLoop == L)
+        formLCSSARecursively(*Prologue, *DT, LI, SE);
+    }
+
+#ifndef NDEBUG
+    assert(!verifyFunction(*F, &dbgs()) && "Splitting broke the function");
+    DT->verifyDomTree();
+    assert(L->isLoopSimplifyForm() && "Split loop not simplified");
+    assert(Prologue->isLoopSimplifyForm() && "Prologue not simplified");
+#endif
+
+    DEBUG(L->print(dbgs()));
+    NumSplitLoops++;
+    return true;
+  }/*}-}*/
+
+  /// Collect in Slice (header phis first, then in def-use order) the
+  /// instructions of L needed to compute the removable commands of degree at
+  /// most \p PeelCount, returned in Commands. Return false if one of these
+  /// commands is a chunk or if the slice is not pure: the first iterations
+  /// then have to be peeled entirely./*{-{*/
+  static bool collectPeelSlice(Loop* L, unsigned PeelCount, MapChunk* mapChunk,
+                               std::vector<Value*> *OC, DominatorTree* DT,
+                               LoopInfo* LI,
+                               SmallSetVector<Instruction*, 16> &Slice,
+                               SmallVectorImpl<Instruction*> &Commands){
+    BasicBlock* Header = L->getHeader();
+    BasicBlock* Latch = L->getLoopLatch();
+    MapDeg *mapDeg = (*mapChunk)[Header]->getMapDeg();
+    SmallPtrSet<Instruction*, 16> InSlice;
+    SmallVector<Instruction*, 16> WorkList;
+    for(Value* V : *OC){
+      if(!isRemovableAfterPeel(V, L, mapChunk, mapDeg, DT, LI) ||
+         (*mapDeg)[V] > (int)PeelCount)
+        continue;
+      if(isa<BasicBlock>(V) || isa<TerminatorInst>(V))
+        return false;
+      Commands.push_back(cast<Instruction>(V));
+      WorkList.push_back(cast<Instruction>(V));
+    }
+    if(Commands.empty())
+      return false;
+
+    while(!WorkList.empty()){
+      Instruction* I = WorkList.pop_back_val();
+      if(!L->contains(I->getParent()) || !InSlice.insert(I).second)
+        continue;
+      if(PHINode* PN = dyn_cast<PHINode>(I)){
+        // Only the recurrences of the loop are followed
+        if(PN->getParent() != Header)
+          return false;
+        if(Instruction* In =
+           dyn_cast<Instruction>(PN->getIncomingValueForBlock(Latch)))
+          WorkList.push_back(In);
+        continue;
+      }
+      if(LI->getLoopFor(I->getParent()) != L ||
+         !DT->dominates(I->getParent(), Latch) ||
+         I->mayHaveSideEffects() || I->mayReadFromMemory() ||
+         !isSafeToSpeculativelyExecute(I))
+        return false;
+      for(Value* Op : I->operands())
+        if(Instruction* OpI = dyn_cast<Instruction>(Op))
+          WorkList.push_back(OpI);
+    }
+
+    // The blocks in RPO give a def-use order
+    LoopBlocksDFS DFS(L);
+    DFS.perform(LI);
+    for(auto BI = DFS.beginRPO(), BE = DFS.endRPO(); BI != BE; ++BI)
+      for(Instruction &I : **BI)
+        if(InSlice.count(&I))
+          Slice.insert(&I);
+    return true;
+  }/*}-}*/
+
+  // Size of the code cloned by slicePeelLoop/*{-{*/
+  static unsigned getSliceCost(SmallSetVector<Instruction*, 16> &Slice,
+                               const TargetTransformInfo* TTI){
+    unsigned cost = 0;
+    for(Instruction* I : Slice)
+      cost += TTI->getUserCost(I);
+    return cost;
+  }/*}-}*/
+
+  /// Peel only the slice computing the quasi-invariant commands: the first
+  /// \p PeelCount iterations of the slice run straight in the preheader, the
+  /// whole loop runs as before. A command of degree d takes its values of
+  /// the first iterations through a chain of d-1 header phis, then the value
+  /// of iteration d forever.
+  ///
+  /// PreHeader:                      PreHeader:
+  /// Header:                         Header.peel.slice:
+  ///   x = phi [x0, PreHeader]         v0 = C(iteration 0)
+  ///   …                               v1 = C(iteration 1)
+  ///   c = C(x)               →      Header:
+  ///   …                               c = phi [v0, Header.peel.slice],
+  ///                                           [v1, Latch]
+  ///                                   …   (C removed, uses of C use c)
+  ///
+  /// Nothing else is cloned and the slice is pure, so it is safe to compute
+  /// even if the loop runs fewer iterations./*{-{*/
+  bool slicePeelLoop(Loop *L, unsigned PeelCount,
+                     SmallSetVector<Instruction*, 16> &Slice,
+                     SmallVectorImpl<Instruction*> &Commands,
+                     MapChunk* mapChunk, LoopInfo *LI, ScalarEvolution *SE,
+                     DominatorTree *DT){
+    DEBUG(dbgs() <<"**************in slicePeelLoop !****************\n");
+    if (!canPeel(L))
+      return false;
+    BasicBlock *Header = L->getHeader();
+    BasicBlock *Latch = L->getLoopLatch();
+    Chunk* currentChunk = (*mapChunk)[Header];
+    MapDeg *mapDeg = currentChunk->getMapDeg();
+    SE->forgetLoop(L);
+
+    BasicBlock *SliceBB = SplitEdge(L->getLoopPreheader(), Header, DT, LI);
+    SliceBB->setName(Header->getName() + ".peel.slice");
+    Instruction *InsertPt = SliceBB->getTerminator();
+
+    // Values of the commands in each iteration
+    DenseMap<Instruction*, SmallVector<Value*, 8>> Values;
+    ValueToValueMapTy LVMap;
+    for(unsigned Iter = 0; Iter < PeelCount; ++Iter){
+      ValueToValueMapTy VMap;
+      for(Instruction* I : Slice){
+        if(PHINode* PN = dyn_cast<PHINode>(I)){
+          Value* In = Iter ? PN->getIncomingValueForBlock(Latch) :
+            PN->getIncomingValueForBlock(SliceBB);
+          if(Iter)
+            if(Value* Last = LVMap.lookup(In))
+              In = Last;
+          VMap[PN] = In;
+          continue;
+        }
+        Instruction* NewI = I->clone();
+        NewI->setName(I->getName() + ".peel");
+        NewI->insertBefore(InsertPt);
+        RemapInstruction(NewI, VMap,
+                         RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+        VMap[I] = NewI;
+      }
+      for(Instruction* C : Commands)
+        Values[C].push_back(VMap[C]);
+      LVMap.clear();
+      for(Instruction* I : Slice)
+        LVMap[I] = VMap[I];
+    }
+
+    // The header phis give to each iteration the value of the command
+    for(Instruction* C : Commands){
+      unsigned Deg = (*mapDeg)[C];
+      SmallVectorImpl<Value*> &Vals = Values[C];
+      Value* Next = Vals[Deg - 1];
+      for(unsigned j = Deg - 1; j-- > 0;){
+        PHINode* PN = PHINode::Create(C->getType(), 2,
+                                      C->getName() + ".peel.iter",
+                                      &Header->front());
+        PN->addIncoming(Vals[j], SliceBB);
+        PN->addIncoming(Next, Latch);
+        Next = PN;
+      }
+      DEBUG(dbgs() << "ReplaceAllUses of" << *C << " With " << *Next << "\n");
+      C->replaceAllUsesWith(Next);
+      forgetValue(C, mapChunk, mapDeg);
+      C->eraseFromParent();
+      NumHoistedInsts++;
+    }
+    currentChunk->setPeeled(true);
     if (Loop *ParentLoop = L->getParentLoop())
       SE->forgetLoop(ParentLoop);
 
+#ifndef NDEBUG
+    assert(!verifyFunction(*Header->getParent(), &dbgs()) &&
+           "Slice peeling broke the function");
+#endif
+    NumSlicePeeled++;
     return true;
-  }
+  }/*}-}*/
+
+  /// Version L on Cond, computed in its preheader, like LoopVersioning does
+  /// on memory checks: L runs when Cond is true, a clone of L (returned) runs
+  /// otherwise.
+  ///
+  /// PreHeader:
+  ///   If (Cond) goto Header.ph else goto Header.ph<Suffix>
+  /// Header.ph:                Header.ph<Suffix>:
+  ///   L                         clone of L
+  /// Exit: (phis merge the values of both loops)/*{-{*/
+  Loop* versionLoop(Loop *L, Value *Cond, const Twine &Suffix, LoopInfo *LI,
+                    DominatorTree *DT, ScalarEvolution *SE,
+                    bool PreserveLCSSA) {
+    BasicBlock *RuntimeCheckBB = L->getLoopPreheader();
+    BasicBlock *Exit = L->getUniqueExitBlock();
+    BasicBlock *Exiting = L->getExitingBlock();
+    SE->forgetLoop(L);
+
+    // Create empty preheader for the loop (and after cloning for the
+    // non-versioned loop).
+    BasicBlock *PH =
+      SplitBlock(RuntimeCheckBB, RuntimeCheckBB->getTerminator(), DT, LI);
+    PH->setName(L->getHeader()->getName() + ".ph");
+
+    // Clone the loop including the preheader.
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock *, 8> NonVersionedLoopBlocks;
+    Loop *NonVersionedLoop =
+      cloneLoopWithPreheader(PH, RuntimeCheckBB, L, VMap, Suffix, LI, DT,
+                             NonVersionedLoopBlocks);
+    remapInstructionsInBlocks(NonVersionedLoopBlocks, VMap);
+
+    // Insert the conditional branch based on the guard.
+    Instruction *OrigTerm = RuntimeCheckBB->getTerminator();
+    BranchInst::Create(PH, NonVersionedLoop->getLoopPreheader(), Cond,
+                       OrigTerm);
+    OrigTerm->eraseFromParent();
+
+    // The loops merge in the original exit block, its LCSSA phis take the
+    // values of both.
+    BasicBlock *NewExiting = cast<BasicBlock>(VMap[Exiting]);
+    for (BasicBlock::iterator I = Exit->begin(); isa<PHINode>(I); ++I) {
+      PHINode *PHI = cast<PHINode>(I);
+      Value *V = PHI->getIncomingValueForBlock(Exiting);
+      Value *NewV = VMap.lookup(V);
+      PHI->addIncoming(NewV ? NewV : V, NewExiting);
+    }
+    DT->changeImmediateDominator(Exit, RuntimeCheckBB);
+
+    // The exit is shared, get back dedicated exits
+    simplifyLoop(L, DT, LI, SE, nullptr, PreserveLCSSA);
+    simplifyLoop(NonVersionedLoop, DT, LI, SE, nullptr, PreserveLCSSA);
+    if (Loop *ParentLoop = L->getParentLoop())
+      SE->forgetLoop(ParentLoop);
+    return NonVersionedLoop;
+  }/*}-}*/
+
+  /// Check whether versionLoopOnTripCount can version L: a loop not
+  /// versioned yet whose backedge-taken count is cheap to expand./*{-{*/
+  static bool canVersionOnTripCount(Loop *L, ScalarEvolution *SE) {
+    if (!canPeel(L) || findStringMetadataForLoop(L, "llvm.loop.lqicm.versioned"))
+      return false;
+    const SCEV *BTC = SE->getBackedgeTakenCount(L);
+    if (isa<SCEVCouldNotCompute>(BTC))
+      return false;
+    const DataLayout &DL = L->getHeader()->getModule()->getDataLayout();
+    SCEVExpander Exp(*SE, DL, "lqicm.version");
+    return !Exp.isHighCostExpansion(BTC, L);
+  }/*}-}*/
+
+  /// Version L on its trip count: L runs when its backedge is taken at least
+  /// \p Deg times, a clone of L runs otherwise. The guard is expanded from the
+  /// backedge-taken count computed by SE. Return the clone, or nullptr if L
+  /// can't be versioned./*{-{*/
+  Loop* versionLoopOnTripCount(Loop *L, unsigned Deg, LoopInfo *LI,
+                               DominatorTree *DT, ScalarEvolution *SE,
+                               bool PreserveLCSSA) {
+    if (!canVersionOnTripCount(L, SE))
+      return nullptr;
+    const SCEV *BTC = SE->getBackedgeTakenCount(L);
+    BasicBlock *RuntimeCheckBB = L->getLoopPreheader();
+    BasicBlock *Header = L->getHeader();
+    const DataLayout &DL = Header->getModule()->getDataLayout();
+    SCEVExpander Exp(*SE, DL, "lqicm.version");
+
+    DEBUG(dbgs() << "Versioning " << Header->getName() << " on " << *BTC
+          << " >= " << Deg << "\n");
+    Value *Count = Exp.expandCodeFor(BTC, BTC->getType(),
+                                     RuntimeCheckBB->getTerminator());
+    Value *RuntimeCheck =
+      new ICmpInst(RuntimeCheckBB->getTerminator(), ICmpInst::ICMP_UGE, Count,
+                   ConstantInt::get(BTC->getType(), Deg), "lqicm.version.guard");
+    RuntimeCheckBB->setName(RuntimeCheckBB->getName() + ".lqicm.check");
+    Loop *NonVersionedLoop = versionLoop(L, RuntimeCheck, ".lqicm.orig", LI,
+                                         DT, SE, PreserveLCSSA);
+
+    // Neither loop is versioned again
+    addStringMetadataToLoop(L, "llvm.loop.lqicm.versioned");
+    addStringMetadataToLoop(NonVersionedLoop, "llvm.loop.lqicm.versioned");
+    NumVersionedLoops++;
+    return NonVersionedLoop;
+  }/*}-}*/
+
+  /// Unswitch L on the forks whose condition became invariant once L has
+  /// been peeled (or split) as many times as the degree of the fork: L keeps
+  /// the true side, a clone of L the false side. The conditions are replaced
+  /// by constants, simplifycfg removes the dead sides. At most \p MaxCount
+  /// forks are unswitched, the loops stay under \p SizeThreshold. Return the
+  /// number of forks unswitched./*{-{*/
+  unsigned unswitchQuasiInvariantForks(Loop *L, unsigned Deg,
+                                       MapChunk *mapChunk, LoopInfo *LI,
+                                       DominatorTree *DT, ScalarEvolution *SE,
+                                       const TargetTransformInfo *TTI,
+                                       unsigned MaxCount,
+                                       unsigned SizeThreshold,
+                                       bool PreserveLCSSA) {
+    // Conditions of the fork chunks of the remaining body, stable after Deg
+    // iterations
+    SmallSetVector<Value*, 4> Conds;
+    for (BasicBlock *BB : L->blocks()) {
+      BranchInst *BI = dyn_cast<BranchInst>(BB->getTerminator());
+      if (!BI || !BI->isConditional() || BB == L->getHeader() ||
+          LI->getLoopFor(BB) != L || !mapChunk->count(BI))
+        continue;
+      Chunk *C = (*mapChunk)[BI];
+      if (C->getType() != Chunk::FORK || C->getDegree() < 1 ||
+          C->getDegree() > (int)Deg)
+        continue;
+      // The peeled iterations gave its value to the condition
+      if (L->isLoopInvariant(BI->getCondition()) &&
+          !isa<Constant>(BI->getCondition()))
+        Conds.insert(BI->getCondition());
+    }
+
+    // Set the branches of V on Cond to Val
+    auto setBranches = [](Loop *V, Value *Cond, Constant *Val) {
+      for (BasicBlock *BB : V->blocks())
+        if (BranchInst *BI = dyn_cast<BranchInst>(BB->getTerminator()))
+          if (BI->isConditional() && BI->getCondition() == Cond)
+            BI->setCondition(Val);
+    };
+
+    unsigned NumUnswitched = 0;
+    unsigned LoopSize = getLoopCost(L, TTI);
+    std::vector<Loop*> Versions(1, L);
+    for (Value *Cond : Conds) {
+      // Each fork doubles the code of the loop
+      if (NumUnswitched == MaxCount ||
+          LoopSize * Versions.size() * 2 > SizeThreshold)
+        break;
+      DEBUG(dbgs() << "Unswitching " << L->getHeader()->getName() << " on "
+            << *Cond << "\n");
+      LLVMContext &Ctx = Cond->getContext();
+      unsigned NumVersions = Versions.size();
+      for (unsigned i = 0; i < NumVersions; ++i) {
+        Loop *FalseLoop = versionLoop(Versions[i], Cond, ".lqicm.us", LI, DT,
+                                      SE, PreserveLCSSA);
+        setBranches(Versions[i], Cond, ConstantInt::getTrue(Ctx));
+        setBranches(FalseLoop, Cond, ConstantInt::getFalse(Ctx));
+        Versions.push_back(FalseLoop);
+      }
+      NumUnswitched++;
+      NumUnswitchedForks++;
+    }
+    return NumUnswitched;
+  }/*}-}*/
 
 }
 
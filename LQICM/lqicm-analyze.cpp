@@ -0,0 +1,275 @@
+//===-- lqicm-analyze.cpp - Run the LQICM analysis on bitcode files --------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+//===----------------------------------------------------------------------===//
+//
+// Load .bc/.ll files, run the passes LQICM expects and LQICM on every function
+// and print one line per loop, built from the remarks of the pass. The files
+// are analyzed in parallel, each worker has its own LLVMContext, and the
+// report follows the order of the files.
+//
+//   lqicm-analyze -j 16 corpus/*.bc [-lqicm-... options]
+//
+// With -merge-reports the inputs are the JSON records written by
+// -lqicm-report, for instance one file per translation unit, and the totals
+// of the project are printed as JSON.
+//
+//   lqicm-analyze -merge-reports reports/*.jsonl
+//
+//===----------------------------------------------------------------------===//
+
+#include "./LQICM.h"
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace llvm;
+
+static cl::list<std::string>
+InputFiles(cl::Positional, cl::OneOrMore,
+           cl::desc("<input .bc/.ll files or -lqicm-report files>"));
+
+static cl::opt<bool>
+MergeReports("merge-reports",
+             cl::desc("Print the totals of -lqicm-report files as JSON"));
+
+static cl::opt<unsigned>
+Jobs("j", cl::init(0),
+     cl::desc("Number of files analyzed in parallel (0 for one per core)"));
+
+namespace {
+// What the analysis of one file gives
+struct FileReport {
+  std::vector<std::string> Lines;
+  unsigned NumAnalyzed = 0;
+  unsigned NumMissed = 0;
+  std::string Error;
+};
+}
+
+// Turn each remark of LQICM in a line of the report/*{-{*/
+static void handleDiagnostic(const DiagnosticInfo &DI, void *Context) {
+  FileReport &Report = *static_cast<FileReport *>(Context);
+  auto *Remark = dyn_cast<DiagnosticInfoOptimizationBase>(&DI);
+  if(!Remark) {
+    if(DI.getSeverity() == DS_Error) {
+      raw_string_ostream OS(Report.Error);
+      DiagnosticPrinterRawOStream DP(OS);
+      DI.print(DP);
+    }
+    return;
+  }
+  if(StringRef(Remark->getPassName()) != "lqicm")
+    return;
+
+  StringRef Kind = "passed";
+  if(DI.getKind() == DK_OptimizationRemarkMissed) {
+    Kind = "missed";
+    // The other missed remarks are about the transforms
+    Report.NumMissed += StringSwitch<bool>(Remark->getRemarkName())
+      .Cases("NotSimplified", "ColdLoop", "NoPreheader", true)
+      .Cases("AnalysisFailed", "OverBudget", true)
+      .Default(false);
+  } else if(DI.getKind() == DK_OptimizationRemarkAnalysis) {
+    Kind = "analysis";
+    Report.NumAnalyzed += Remark->getRemarkName() == "Degrees";
+  }
+  std::string Line;
+  raw_string_ostream OS(Line);
+  OS << Remark->getFunction().getName() << ":" << Remark->getLocationStr()
+     << ": " << Kind << " " << Remark->getRemarkName() << ": "
+     << Remark->getMsg();
+  Report.Lines.push_back(OS.str());
+}/*}-}*/
+
+// Analyze the file File, in its own context/*{-{*/
+static void analyzeFile(const std::string &File, FileReport &Report) {
+  LLVMContext Context;
+  Context.setDiagnosticHandler(handleDiagnostic, &Report);
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = parseIRFile(File, Err, Context);
+  if(!M) {
+    raw_string_ostream OS(Report.Error);
+    Err.print("lqicm-analyze", OS, false);
+    return;
+  }
+  legacy::PassManager PM;
+  addLQICMPasses(PM);
+  PM.run(*M);
+}/*}-}*/
+
+// The value of the field Key of a record. The fields read come before the
+// objects (phases, commands) and are numbers or strings without escapes./*{-{*/
+static StringRef getField(StringRef Record, StringRef Key) {
+  Record = Record.substr(0, std::min(Record.find(",\"phases\":"),
+                                     Record.find(",\"commands\":")));
+  std::string Pattern = ("\"" + Key + "\":").str();
+  size_t Pos = Record.find(Pattern);
+  if(Pos == StringRef::npos)
+    return StringRef();
+  StringRef Val = Record.substr(Pos + Pattern.size());
+  if(Val.startswith("\""))
+    return Val.substr(1, Val.find('"', 1) - 1);
+  return Val.substr(0, Val.find_first_of(",}"));
+}/*}-}*/
+
+// Add the phases of a record to Times/*{-{*/
+static void addPhases(StringRef Record, std::map<std::string, double> &Times) {
+  size_t Pos = Record.find(",\"phases\":{");
+  if(Pos == StringRef::npos)
+    return;
+  StringRef Phases = Record.substr(Pos + 11);
+  Phases = Phases.substr(0, Phases.find('}'));
+  SmallVector<StringRef, 8> Fields;
+  Phases.split(Fields, ',', -1, false);
+  for(StringRef Field : Fields) {
+    std::pair<StringRef, StringRef> KV = Field.split(':');
+    Times[KV.first.trim('"').str()] +=
+      std::strtod(KV.second.str().c_str(), nullptr);
+  }
+}/*}-}*/
+
+// Print the counts of Counts as a JSON object/*{-{*/
+static void printCounts(raw_ostream &OS,
+                        const std::map<std::string, unsigned> &Counts) {
+  OS << "{";
+  for(auto I = Counts.begin(), E = Counts.end(); I != E; ++I)
+    OS << (I == Counts.begin() ? "" : ",") << "\"" << I->first << "\":"
+       << I->second;
+  OS << "}";
+}/*}-}*/
+
+// Sum the records of the -lqicm-report files/*{-{*/
+static int mergeReports() {
+  unsigned NumFiles = 0, NumErrors = 0, NumLoops = 0, NumAnchors = 0;
+  unsigned NumQuasiInvariantLoops = 0;
+  uint64_t NumQuasiInvariants = 0, NumHoistable = 0;
+  double Time = 0;
+  std::map<std::string, unsigned> Outcomes, Peels;
+  std::map<std::string, double> PhaseTimes;
+  for(const std::string &File : InputFiles) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> Buf = MemoryBuffer::getFile(File);
+    if(!Buf) {
+      errs() << File << ": " << Buf.getError().message() << "\n";
+      NumErrors++;
+      continue;
+    }
+    NumFiles++;
+    for(line_iterator I(**Buf), E; I != E; ++I) {
+      StringRef Record = *I;
+      NumLoops++;
+      Outcomes[getField(Record, "outcome").str()]++;
+      NumAnchors += getField(Record, "anchor") == "true";
+      int MaxDegree;
+      if(!getField(Record, "max_degree").getAsInteger(10, MaxDegree) &&
+         MaxDegree > 0)
+        NumQuasiInvariantLoops++;
+      unsigned N;
+      if(!getField(Record, "num_quasi_invariants").getAsInteger(10, N))
+        NumQuasiInvariants += N;
+      if(!getField(Record, "hoistable_insts").getAsInteger(10, N))
+        NumHoistable += N;
+      Time += std::strtod(getField(Record, "time_s").str().c_str(), nullptr);
+      StringRef Peel = getField(Record, "peel");
+      if(!Peel.empty())
+        Peels[Peel.str()]++;
+      addPhases(Record, PhaseTimes);
+    }
+  }
+
+  raw_ostream &OS = outs();
+  OS << "{\"files\":" << NumFiles << ",\"loops\":" << NumLoops
+     << ",\"outcomes\":";
+  printCounts(OS, Outcomes);
+  OS << ",\"anchors\":" << NumAnchors
+     << ",\"quasi_invariant_loops\":" << NumQuasiInvariantLoops
+     << ",\"quasi_invariants\":" << NumQuasiInvariants
+     << ",\"hoistable_insts\":" << NumHoistable << ",\"peel\":";
+  printCounts(OS, Peels);
+  OS << ",\"time_s\":" << format("%.6f", Time);
+  if(!PhaseTimes.empty()) {
+    OS << ",\"phases\":{";
+    for(auto I = PhaseTimes.begin(), E = PhaseTimes.end(); I != E; ++I)
+      OS << (I == PhaseTimes.begin() ? "" : ",") << "\"" << I->first << "\":"
+         << format("%.6f", I->second);
+    OS << "}";
+  }
+  OS << "}\n";
+  return NumErrors ? 1 : 0;
+}/*}-}*/
+
+int main(int argc, char **argv) {
+  sys::PrintStackTraceOnErrorSignal(argv[0]);
+  PrettyStackTraceProgram X(argc, argv);
+  llvm_shutdown_obj Y;
+
+  PassRegistry &Registry = *PassRegistry::getPassRegistry();
+  initializeCore(Registry);
+  initializeScalarOpts(Registry);
+  initializeIPO(Registry);
+  initializeAnalysis(Registry);
+  initializeTransformUtils(Registry);
+  initializeInstCombine(Registry);
+  initializeTarget(Registry);
+
+  // The report is made of the remarks of LQICM, they must all be emitted
+  std::vector<const char *> Args(argv, argv + argc);
+  Args.push_back("-pass-remarks=lqicm");
+  Args.push_back("-pass-remarks-missed=lqicm");
+  Args.push_back("-pass-remarks-analysis=lqicm");
+  cl::ParseCommandLineOptions(Args.size(), Args.data(),
+                              "LQICM analysis of bitcode files\n");
+  if(MergeReports)
+    return mergeReports();
+
+  std::vector<FileReport> Reports(InputFiles.size());
+  {
+    unsigned NumThreads = Jobs;
+    if(!NumThreads)
+      NumThreads = std::max(1u, std::thread::hardware_concurrency());
+    ThreadPool Pool(NumThreads);
+    for(unsigned i = 0, e = InputFiles.size(); i != e; ++i)
+      Pool.async(analyzeFile, std::cref(InputFiles[i]), std::ref(Reports[i]));
+    Pool.wait();
+  }
+
+  unsigned NumAnalyzed = 0, NumMissed = 0, NumErrors = 0;
+  for(unsigned i = 0, e = InputFiles.size(); i != e; ++i) {
+    FileReport &Report = Reports[i];
+    if(!Report.Error.empty()) {
+      errs() << Report.Error;
+      NumErrors++;
+    }
+    for(const std::string &Line : Report.Lines)
+      outs() << InputFiles[i] << ":" << Line << "\n";
+    NumAnalyzed += Report.NumAnalyzed;
+    NumMissed += Report.NumMissed;
+  }
+  errs() << InputFiles.size() << " files, " << NumAnalyzed
+         << " loops analyzed, " << NumMissed << " loops not analyzed, "
+         << NumErrors << " errors\n";
+  return NumErrors ? 1 : 0;
+}
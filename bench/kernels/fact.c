@@ -0,0 +1,32 @@
+/* Fact.c made deterministic: the factorial loop is invariant in the outer
+ * loop (degree 1).
+ *   fact [n]
+ */
+#include<stdio.h>
+#include<stdlib.h>
+
+unsigned checksum;
+
+__attribute__((noinline)) void use2(int i, unsigned fact){
+    checksum = checksum*31 + i;
+    checksum = checksum*31 + fact;
+}
+
+int main(int argc, char **argv){
+    int i=0;
+    unsigned fact;
+    int n = argc > 1 ? atoi(argv[1]) : 20000;
+    int j=0;
+    while(j<n){
+        fact=1;
+        i=1;
+        while (i<=n) {
+            fact=fact*i;
+            i=i+1;
+        }
+        use2(i, fact);
+        j=j+1;
+    }
+    printf("%d %u\n", i, checksum);
+    return 0;
+}
@@ -0,0 +1,45 @@
+/* Fact4.c made deterministic: the factorial loop is invariant of degree 4,
+ * its bound y is only stable from the second iteration.
+ *   fact4 [n [x]]
+ */
+#include<stdio.h>
+#include<stdlib.h>
+
+unsigned checksum;
+
+__attribute__((noinline)) void use(int y){
+    checksum = checksum*31 + y;
+}
+
+int main(int argc, char **argv){
+    int i=0;
+    unsigned fact;
+    int n = argc > 1 ? atoi(argv[1]) : 200000;
+    int x = argc > 2 ? atoi(argv[2]) : 1000;
+    int j=0;
+    int y=5;
+    int a=5;
+    while(j<n){
+        fact=1;
+        i=1;
+        while (i<=y) {
+            fact=fact*i;
+            i=i+1;
+        }
+        use(i);
+        use(fact);
+        if(x>100){
+          y=x+a;
+        }
+        use(y);
+        if(x<=100){
+          y=x+100;
+        }
+        use(y);
+        i=j;
+        a=0;
+        j=i+1;
+    }
+    printf("%d %u\n", i, checksum);
+    return 0;
+}
@@ -0,0 +1,36 @@
+/* innerLoopPeeled.c made deterministic: z=y*y becomes invariant once the
+ * inner loop has been peeled once.
+ *   inner_loop_peeled [n [x [y]]]
+ */
+#include<stdio.h>
+#include<stdlib.h>
+
+unsigned checksum;
+
+__attribute__((noinline)) void use(int y){
+    checksum = checksum*31 + y;
+}
+
+int main(int argc, char **argv){
+    int i=0;
+    int n = argc > 1 ? atoi(argv[1]) : 5000;
+    int x = argc > 2 ? atoi(argv[2]) : 42;
+    int y = argc > 3 ? atoi(argv[3]) : 17;
+    int j=0;
+    int z=0;
+    while(j<n){
+        i=1;
+        while(i<=n){
+          z=y*y;
+          use(z);
+          y=x+x;
+          use(y);
+          i=i+1;
+        }
+        use(y);
+        use(z);
+        j=j+1;
+    }
+    printf("%d %d %u\n", y, z, checksum);
+    return 0;
+}
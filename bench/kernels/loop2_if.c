@@ -0,0 +1,34 @@
+/* Loop2_if.c made deterministic: x, then the fork on x and y, are invariant
+ * from the second iteration.
+ *   loop2_if [n [x [x2]]]
+ */
+#include<stdio.h>
+#include<stdlib.h>
+
+unsigned checksum;
+
+__attribute__((noinline)) void use(int y){
+    checksum = checksum*31 + y;
+}
+
+int main(int argc, char **argv){
+    int i=0,y=0;
+    int n = argc > 1 ? atoi(argv[1]) : 50000000;
+    int x = argc > 2 ? atoi(argv[2]) : 42;
+    int x2 = argc > 3 ? atoi(argv[3]) : 77;
+    int z=0;
+    while(i<n){
+        z=y*y;
+        use(z);
+        if(x<50)
+          y=x+x;
+        else
+          y=0;
+        use(y);
+        x=x2;
+        use(x);
+        i++;
+    }
+    printf("%d %d %u\n", y, z, checksum);
+    return 0;
+}
@@ -0,0 +1,34 @@
+/* nested_loop.c made deterministic: the factorial loop with an early exit is
+ * invariant in the outer loop.
+ *   nested_loop [n]
+ */
+#include<stdio.h>
+#include<stdlib.h>
+
+unsigned checksum;
+
+__attribute__((noinline)) void use2(int i, unsigned fact){
+    checksum = checksum*31 + i;
+    checksum = checksum*31 + fact;
+}
+
+int main(int argc, char **argv){
+    int i=0;
+    unsigned fact;
+    int n = argc > 1 ? atoi(argv[1]) : 20000000;
+    int j=0;
+    while(j<n){
+        fact=1;
+        i=1;
+        while (i<=n) {
+            fact=fact*i;
+            if(fact>9000)
+              break;
+            i=i+1;
+        }
+        use2(i, fact);
+        j=j+1;
+    }
+    printf("%d %u\n", i, checksum);
+    return 0;
+}
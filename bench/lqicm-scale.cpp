@@ -0,0 +1,292 @@
+//===-- lqicm-scale.cpp - Compile-time scaling of the LQICM analysis -------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+//===----------------------------------------------------------------------===//
+//
+// Generate a synthetic loop nest, run the passes LQICM expects and LQICM on
+// it and print a CSV row: the parameters, the time of each phase of the
+// analysis and the peak memory. scale.sh grows one parameter at a time to
+// show how the analysis scales.
+//
+//   lqicm-scale -insts=256 -vars=8 -chain=4 -forks=2 -depth=2
+//   lqicm-scale -insts=256 -emit-ll > kernel.ll
+//
+// The innermost loop has -vars variables carried by the loop, a chain of
+// -chain variables (c1 = c2, ..., cN = inv*b, so c1 has degree N), -insts
+// instructions mixing invariant and variant values and -forks forks on
+// invariant conditions. The -depth-1 outer loops sum the result of the loop
+// they hold.
+//
+//===----------------------------------------------------------------------===//
+
+#include "../LQICM/LQICM.h"
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <sys/resource.h>
+#include <string>
+#include <vector>
+using namespace llvm;
+
+static cl::opt<unsigned>
+NumInsts("insts", cl::init(16),
+         cl::desc("Number of instructions in the body of the innermost loop"));
+
+static cl::opt<unsigned>
+NumVars("vars", cl::init(2),
+        cl::desc("Number of variables carried by the innermost loop"));
+
+static cl::opt<unsigned>
+ChainLength("chain", cl::init(2),
+            cl::desc("Length of the chain of variables, its degree"));
+
+static cl::opt<unsigned>
+NumForks("forks", cl::init(1),
+         cl::desc("Number of forks on invariant conditions"));
+
+static cl::opt<unsigned>
+Depth("depth", cl::init(1), cl::desc("Depth of the loop nest"));
+
+static cl::opt<unsigned>
+Repeat("repeat", cl::init(3),
+       cl::desc("Number of runs, the fastest one is printed"));
+
+static cl::opt<bool>
+EmitLL("emit-ll", cl::desc("Print the generated module instead of timing"));
+
+static cl::opt<bool>
+CSVHeader("csv-header", cl::desc("Print the header of the CSV and exit"));
+
+// The phases timed by LQICM, in the order of the columns
+static const char *const Phases[] = {"alias", "phi", "body", "fixpoint",
+                                     "depchunks", "degrees", "peel"};
+
+namespace {
+// Builds the kernel function of the module
+struct KernelBuilder {
+  LLVMContext &Ctx;
+  Function *F;
+  IRBuilder<> B;
+  Type *Int32;
+  Value *N, *A, *Bv, *D;
+
+  KernelBuilder(Module &M)
+    : Ctx(M.getContext()), B(M.getContext()), Int32(B.getInt32Ty()) {
+    Type *Params[] = {Int32, Int32, Int32, Int32, Int32->getPointerTo()};
+    FunctionType *FTy = FunctionType::get(B.getVoidTy(), Params, false);
+    F = Function::Create(FTy, GlobalValue::ExternalLinkage, "kernel", &M);
+    auto AI = F->arg_begin();
+    N = &*AI++;
+    N->setName("n");
+    A = &*AI++;
+    A->setName("a");
+    Bv = &*AI++;
+    Bv->setName("b");
+    D = &*AI++;
+    D->setName("d");
+    Value *Out = &*AI;
+    Out->setName("out");
+
+    B.SetInsertPoint(BasicBlock::Create(Ctx, "entry", F));
+    Value *Result = emitLoop(0);
+    B.CreateStore(Result, Out);
+    B.CreateRetVoid();
+  }
+
+  // The body of the innermost loop, Vars and Chain are the phis of its
+  // header. Return the value of each phi on the latch./*{-{*/
+  std::vector<Value *> emitKernel(Value *I, ArrayRef<PHINode *> Vars,
+                                  ArrayRef<PHINode *> Chain) {
+    Value *Inv = A, *Var = Vars[0];
+    for(unsigned k = 0; k < NumInsts; ++k) {
+      switch(k % 3) {
+      case 0:
+        Inv = (k / 3) % 2 ? B.CreateMul(Inv, Bv, "inv")
+                          : B.CreateAdd(Inv, B.getInt32(k + 1), "inv");
+        break;
+      case 1:
+        Var = B.CreateXor(Var, Inv, "var");
+        break;
+      default:
+        Var = B.CreateAdd(Var, Vars[k % Vars.size()], "var");
+      }
+    }
+    if(!Chain.empty())
+      Var = B.CreateAdd(Var, Chain[0], "var");
+
+    // Forks on invariant conditions, the division can't be speculated
+    for(unsigned k = 0; k < NumForks; ++k) {
+      BasicBlock *Then = BasicBlock::Create(Ctx, "fork.then", F);
+      BasicBlock *Merge = BasicBlock::Create(Ctx, "fork.merge", F);
+      BasicBlock *From = B.GetInsertBlock();
+      B.CreateCondBr(B.CreateICmpSGT(A, B.getInt32(k), "fork.cond"), Then,
+                     Merge);
+      B.SetInsertPoint(Then);
+      Value *Div = B.CreateSDiv(Var, D, "fork.div");
+      B.CreateBr(Merge);
+      B.SetInsertPoint(Merge);
+      PHINode *Phi = B.CreatePHI(Int32, 2, "var");
+      Phi->addIncoming(Var, From);
+      Phi->addIncoming(Div, Then);
+      Var = Phi;
+    }
+
+    std::vector<Value *> Latch;
+    Latch.push_back(Var);
+    for(unsigned j = 1; j < Vars.size(); ++j)
+      Latch.push_back(B.CreateXor(Vars[j], I, "v.next"));
+    for(unsigned j = 1; j < Chain.size(); ++j)
+      Latch.push_back(Chain[j]);
+    if(!Chain.empty())
+      Latch.push_back(B.CreateMul(Inv, Bv, "c.next"));
+    return Latch;
+  }/*}-}*/
+
+  // The loop at depth Level of the nest, from the current block. Return its
+  // result, available at its exit where the builder is left./*{-{*/
+  Value *emitLoop(unsigned Level) {
+    std::string Prefix = "l" + std::to_string(Level) + ".";
+    BasicBlock *Pre = B.GetInsertBlock();
+    BasicBlock *Header = BasicBlock::Create(Ctx, Prefix + "header", F);
+    BasicBlock *Body = BasicBlock::Create(Ctx, Prefix + "body", F);
+    BasicBlock *Latch = BasicBlock::Create(Ctx, Prefix + "latch", F);
+    BasicBlock *Exit = BasicBlock::Create(Ctx, Prefix + "exit", F);
+    B.CreateBr(Header);
+
+    B.SetInsertPoint(Header);
+    PHINode *I = B.CreatePHI(Int32, 2, Prefix + "i");
+    I->addIncoming(B.getInt32(0), Pre);
+    bool Innermost = Level + 1 >= Depth;
+    // The first variable is the result of the loop
+    std::vector<PHINode *> Vars, Chain;
+    for(unsigned j = 0, e = Innermost ? std::max(1u, NumVars.getValue()) : 1;
+        j < e; ++j) {
+      Vars.push_back(B.CreatePHI(Int32, 2, Prefix + "v"));
+      Vars.back()->addIncoming(B.getInt32(j), Pre);
+    }
+    for(unsigned j = 0, e = Innermost ? ChainLength.getValue() : 0; j < e;
+        ++j) {
+      Chain.push_back(B.CreatePHI(Int32, 2, Prefix + "c"));
+      Chain.back()->addIncoming(B.getInt32(0), Pre);
+    }
+    B.CreateCondBr(B.CreateICmpSLT(I, N, Prefix + "cond"), Body, Exit);
+
+    B.SetInsertPoint(Body);
+    std::vector<Value *> Next;
+    if(Innermost)
+      Next = emitKernel(I, Vars, Chain);
+    else
+      Next.push_back(B.CreateAdd(Vars[0], emitLoop(Level + 1), Prefix + "v"));
+    B.CreateBr(Latch);
+
+    B.SetInsertPoint(Latch);
+    I->addIncoming(B.CreateAdd(I, B.getInt32(1), Prefix + "i.next"), Latch);
+    unsigned k = 0;
+    for(PHINode *Phi : Vars)
+      Phi->addIncoming(Next[k++], Latch);
+    for(PHINode *Phi : Chain)
+      Phi->addIncoming(Next[k++], Latch);
+    B.CreateBr(Header);
+
+    B.SetInsertPoint(Exit);
+    return Vars[0];
+  }/*}-}*/
+};
+}
+
+// Peak resident memory of the process in KB/*{-{*/
+static long getMaxRSS() {
+  struct rusage RU;
+  if(getrusage(RUSAGE_SELF, &RU))
+    return 0;
+#ifdef __APPLE__
+  return RU.ru_maxrss / 1024;
+#else
+  return RU.ru_maxrss;
+#endif
+}/*}-}*/
+
+int main(int argc, char **argv) {
+  sys::PrintStackTraceOnErrorSignal(argv[0]);
+  PrettyStackTraceProgram X(argc, argv);
+  llvm_shutdown_obj Y;
+
+  PassRegistry &Registry = *PassRegistry::getPassRegistry();
+  initializeCore(Registry);
+  initializeScalarOpts(Registry);
+  initializeIPO(Registry);
+  initializeAnalysis(Registry);
+  initializeTransformUtils(Registry);
+  initializeInstCombine(Registry);
+  initializeTarget(Registry);
+
+  std::vector<const char *> Args(argv, argv + argc);
+  Args.push_back("-lqicm-time-phases");
+  cl::ParseCommandLineOptions(Args.size(), Args.data(),
+                              "Compile-time scaling of LQICM\n");
+
+  if(CSVHeader) {
+    outs() << "insts,vars,chain,forks,depth,ir_insts,pipeline_s,lqicm_s";
+    for(const char *Phase : Phases)
+      outs() << "," << Phase << "_s";
+    outs() << ",max_rss_kb\n";
+    return 0;
+  }
+
+  if(EmitLL) {
+    LLVMContext Context;
+    Module M("lqicm-scale", Context);
+    KernelBuilder KB(M);
+    M.print(outs(), nullptr);
+    return 0;
+  }
+
+  unsigned IRInsts = 0;
+  double Best = -1;
+  StringMap<double> BestPhases;
+  for(unsigned r = 0; r < std::max(1u, Repeat.getValue()); ++r) {
+    // A new module each time, the pass may change it
+    LLVMContext Context;
+    Module M("lqicm-scale", Context);
+    KernelBuilder KB(M);
+    IRInsts = 0;
+    for(BasicBlock &BB : *KB.F)
+      IRInsts += BB.size();
+
+    legacy::PassManager PM;
+    addLQICMPasses(PM);
+    takeLQICMPhaseTimes();
+    TimeRecord Start = TimeRecord::getCurrentTime(true);
+    PM.run(M);
+    TimeRecord Elapsed = TimeRecord::getCurrentTime(false);
+    Elapsed -= Start;
+    StringMap<double> Times = takeLQICMPhaseTimes();
+    if(Best < 0 || Elapsed.getWallTime() < Best) {
+      Best = Elapsed.getWallTime();
+      BestPhases = std::move(Times);
+    }
+  }
+
+  double Total = 0;
+  for(auto &P : BestPhases)
+    Total += P.getValue();
+  outs() << NumInsts << "," << NumVars << "," << ChainLength << ","
+         << NumForks << "," << Depth << "," << IRInsts << ","
+         << format("%.6f", Best) << "," << format("%.6f", Total);
+  for(const char *Phase : Phases)
+    outs() << "," << format("%.6f", BestPhases.lookup(Phase));
+  outs() << "," << getMaxRSS() << "\n";
+  return 0;
+}
@@ -0,0 +1,210 @@
+//===-- relation-bench.cpp - Microbenchmarks of the relation engine --------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+//===----------------------------------------------------------------------===//
+//
+// Time the operations of Relation on random relations of a given number of
+// variables and of arrows per variable, built on the arguments of a dummy
+// function. Each benchmark also reports the allocations and the bytes
+// allocated per operation, counted by the operator new of this file.
+//
+//   lqicm-relation-bench --benchmark_filter=Composition
+//
+// This file is the only one including LQICMUtils.h, the pass is not linked.
+//
+//===----------------------------------------------------------------------===//
+
+#include "../LQICM/LQICM.h"
+#include "../LQICM/LQICMUtils.h"
+
+#include "benchmark/benchmark.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <vector>
+using namespace llvm;
+
+// Allocations of the process, the benchmarks are single threaded
+static size_t NumAllocs = 0;
+static size_t NumAllocBytes = 0;
+
+void *operator new(size_t Size) {
+  ++NumAllocs;
+  NumAllocBytes += Size;
+  if(void *P = std::malloc(Size ? Size : 1))
+    return P;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *P) noexcept { std::free(P); }
+
+void operator delete(void *P, size_t) noexcept { std::free(P); }
+
+namespace {
+// The values of the relations, the arguments of a function never run
+struct DummyValues {
+  LLVMContext Context;
+  Module M;
+  std::vector<Value *> Values;
+
+  DummyValues(unsigned N) : M("relation-bench", Context) {
+    Type *Int32 = Type::getInt32Ty(Context);
+    std::vector<Type *> Params(N, Int32);
+    FunctionType *FTy =
+      FunctionType::get(Type::getVoidTy(Context), Params, false);
+    Function *F =
+      Function::Create(FTy, GlobalValue::ExternalLinkage, "values", &M);
+    for(Argument &A : F->args())
+      Values.push_back(&A);
+  }
+};
+
+// Counts the allocations of a benchmark from its creation
+struct AllocCounter {
+  size_t Allocs = NumAllocs, Bytes = NumAllocBytes;
+
+  void report(benchmark::State &State) {
+    State.counters["allocs"] = benchmark::Counter(
+      NumAllocs - Allocs, benchmark::Counter::kAvgIterations);
+    State.counters["bytes"] = benchmark::Counter(
+      NumAllocBytes - Bytes, benchmark::Counter::kAvgIterations);
+  }
+};
+}
+
+static const unsigned MaxVariables = 1024;
+
+static Value *getValue(unsigned i) {
+  static DummyValues *Dummies = new DummyValues(MaxVariables);
+  return Dummies->Values[i];
+}
+
+// A relation on the variables [First, First + NumVars) with NumVars * Density
+// arrows drawn with the seed Seed, of all the kinds. The variables not
+// reached by an arrow propagate./*{-{*/
+static Relation *makeRelation(unsigned First, unsigned NumVars,
+                              unsigned Density, unsigned Seed) {
+  std::mt19937 Gen(Seed);
+  std::uniform_int_distribution<unsigned> Var(First, First + NumVars - 1);
+  std::uniform_int_distribution<int> Kind(PROP, TOTA);
+  VSet Vars;
+  for(unsigned i = First; i < First + NumVars; ++i)
+    Vars.insert(getValue(i));
+  Relation *R = new Relation(Vars);
+  for(Value *V : Vars)
+    R->addPropag(V);
+  for(unsigned i = 0; i < NumVars * Density; ++i)
+    R->addDependence(std::make_pair(getValue(Var(Gen)), getValue(Var(Gen))),
+                     (DepType)Kind(Gen));
+  return R;
+}/*}-}*/
+
+// The variables and the density of a benchmark, the second relation shares
+// half of the variables of the first one
+static unsigned getNumVars(benchmark::State &State) { return State.range(0); }
+static unsigned getDensity(benchmark::State &State) { return State.range(1); }
+
+static void BM_Composition(benchmark::State &State) {/*{-{*/
+  unsigned N = getNumVars(State), D = getDensity(State);
+  Relation *R1 = makeRelation(0, N, D, 1);
+  Relation *R2 = makeRelation(N / 2, N, D, 2);
+  AllocCounter Counter;
+  for(auto _ : State) {
+    Relation *R = R1->composition(R2);
+    benchmark::DoNotOptimize(R);
+    if(R != R1 && R != R2)
+      delete R;
+  }
+  Counter.report(State);
+  State.counters["arrows"] = R1->getNumArrows() + R2->getNumArrows();
+}/*}-}*/
+
+static void BM_SumRelation(benchmark::State &State) {/*{-{*/
+  unsigned N = getNumVars(State), D = getDensity(State);
+  Relation *R1 = makeRelation(0, N, D, 1);
+  Relation *R2 = makeRelation(N / 2, N, D, 2);
+  AllocCounter Counter;
+  for(auto _ : State) {
+    Relation *R = R1->sumRelation(R2);
+    benchmark::DoNotOptimize(R);
+    delete R;
+  }
+  Counter.report(State);
+}/*}-}*/
+
+static void BM_FixPoint(benchmark::State &State) {/*{-{*/
+  unsigned N = getNumVars(State), D = getDensity(State);
+  Relation *R = makeRelation(0, N, D, 1);
+  AllocCounter Counter;
+  for(auto _ : State) {
+    Relation *Res = fixPoint(R);
+    benchmark::DoNotOptimize(Res);
+    if(Res != R)
+      delete Res;
+  }
+  Counter.report(State);
+}/*}-}*/
+
+static void BM_ExtendRelation(benchmark::State &State) {/*{-{*/
+  unsigned N = getNumVars(State), D = getDensity(State);
+  Relation *R1 = makeRelation(0, N, D, 1);
+  VSet Vars;
+  for(unsigned i = N / 2; i < N / 2 + N; ++i)
+    Vars.insert(getValue(i));
+  AllocCounter Counter;
+  for(auto _ : State) {
+    Relation *R = R1->extendRelation(R1, Vars);
+    benchmark::DoNotOptimize(R);
+    delete R;
+  }
+  Counter.report(State);
+}/*}-}*/
+
+static void BM_GetIn(benchmark::State &State) {/*{-{*/
+  Relation *R = makeRelation(0, getNumVars(State), getDensity(State), 1);
+  AllocCounter Counter;
+  for(auto _ : State)
+    benchmark::DoNotOptimize(R->getIn().size());
+  Counter.report(State);
+}/*}-}*/
+
+static void BM_GetOut(benchmark::State &State) {/*{-{*/
+  Relation *R = makeRelation(0, getNumVars(State), getDensity(State), 1);
+  AllocCounter Counter;
+  for(auto _ : State)
+    benchmark::DoNotOptimize(R->getOut().size());
+  Counter.report(State);
+}/*}-}*/
+
+// Equal relations, the worst case: all the arrows are compared/*{-{*/
+static void BM_IsEqual(benchmark::State &State) {
+  unsigned N = getNumVars(State), D = getDensity(State);
+  Relation *R1 = makeRelation(0, N, D, 1);
+  Relation *R2 = makeRelation(0, N, D, 1);
+  AllocCounter Counter;
+  for(auto _ : State)
+    benchmark::DoNotOptimize(R1->isEqual(R2));
+  Counter.report(State);
+}/*}-}*/
+
+// From 8 to MaxVars variables, 1 to 16 arrows per variable
+#define LQICM_RELATION_BENCH(Name, MaxVars)                                    \
+  BENCHMARK(Name)->RangeMultiplier(4)->Ranges({{8, MaxVars}, {1, 16}})
+
+// The composition is quadratic in the arrows and the fixpoint composes until
+// it is stable, they stop earlier. fixPoint does not free its intermediate
+// relations, the iterations are capped to bound the memory leaked.
+LQICM_RELATION_BENCH(BM_Composition, 128);
+LQICM_RELATION_BENCH(BM_SumRelation, 512);
+LQICM_RELATION_BENCH(BM_FixPoint, 32)->Iterations(100);
+LQICM_RELATION_BENCH(BM_ExtendRelation, 512);
+LQICM_RELATION_BENCH(BM_GetIn, 512);
+LQICM_RELATION_BENCH(BM_GetOut, 512);
+LQICM_RELATION_BENCH(BM_IsEqual, 512);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,119 @@
+#!/bin/bash
+# Runtime of the kernels of bench/kernels (the test/files programs made
+# deterministic) built at -O2, -O3 and -O3 with LQICM, analysis only then
+# with each of its transforms. The outputs must be the ones of -O2, the only
+# check of the transforms on whole programs. One CSV row per build:
+# the size of its code, its best run time, its instructions counted by
+# `perf stat` (empty without perf) and whether its output is the same.
+#
+#   ./bench/runtime.sh > runtime.csv
+#
+# CLANG (LLVM_BUILD/bin/clang by default, as in run.sh), LQICM_PASS, REPEAT
+# (5) and KERNEL_ARGS (the defaults of the kernels) change the builds and the
+# runs. TRANSFORM_FLAGS adds a build with these flags of the pass.
+
+LLVM_BUILD=${LLVM_BUILD:-"../LLVM_BUILD"}
+clang=${CLANG:-"${LLVM_BUILD}/bin/clang"}
+toLoad=${LQICM_PASS:-"./build/LQICM/libLQICMPass.so"}
+repeat=${REPEAT:-5}
+out=${OUT:-"./build/bench/runtime"}
+kernels=$(dirname "$0")/kernels
+
+if ! [ -x "$clang" ] || ! [ -e "$toLoad" ] ; then
+  echo "need CLANG and the pass (LQICM_PASS), see run.sh" >&2
+  exit 1
+fi
+mkdir -p "$out"
+
+load="-Xclang -load -Xclang $toLoad"
+
+# The flags of the pass given to clang
+mllvm() {
+  local flag
+  for flag in "$@" ; do
+    printf -- " -mllvm %s" "$flag"
+  done
+}
+
+configs=("O2" "O3" "O3-lqicm-analysis")
+flags=("-O2" "-O3" "-O3 $load")
+
+# One build per transform, the transforms are off by default. The slice
+# peeling, the versioning and the unswitching work on peeled loops.
+transforms=(
+  "hoist:-lqicm-hoist-chunks -lqicm-hoist-nest"
+  "peel:-lqicm-peel"
+  "peel-slice:-lqicm-peel -lqicm-peel-slice"
+  "version:-lqicm-peel -lqicm-version"
+  "unswitch:-lqicm-peel -lqicm-unswitch"
+  "split:-lqicm-split"
+  "memoize:-lqicm-memoize"
+  "peel-metadata:-lqicm-peel-metadata"
+)
+if [ -n "$TRANSFORM_FLAGS" ] ; then
+  transforms+=("transform:$TRANSFORM_FLAGS")
+fi
+for transform in "${transforms[@]}" ; do
+  configs+=("O3-lqicm-${transform%%:*}")
+  flags+=("-O3 $load$(mllvm ${transform#*:})")
+done
+
+perf=false
+if perf stat -x, -e instructions true 2>/dev/null ; then
+  perf=true
+fi
+
+# Size of the code of a binary, its text segment
+codeSize() {
+  if command -v size >/dev/null ; then
+    size "$1" | awk 'NR == 2 { print $1 }'
+  else
+    wc -c < "$1"
+  fi
+}
+
+# Best wall time of REPEAT runs of a binary, its output kept in $2
+runBest() {
+  local best="" start end
+  for ((r = 0; r < repeat; r++)) ; do
+    start=$(date +%s.%N)
+    "$1" $KERNEL_ARGS > "$2"
+    end=$(date +%s.%N)
+    best=$(awk -v s="$start" -v e="$end" -v b="$best" \
+      'BEGIN { t = e - s; if(b == "" || t < b) b = t; printf "%.6f", b }')
+  done
+  echo "$best"
+}
+
+# Instructions run by a binary
+countInsts() {
+  $perf || return
+  perf stat -x, -e instructions -o "$2" "$1" $KERNEL_ARGS > /dev/null
+  awk -F, '$3 ~ /^instructions/ { print $1 }' "$2"
+}
+
+status=0
+echo "kernel,config,text_bytes,best_s,instructions,output"
+for file in "$kernels"/*.c ; do
+  name=$(basename "$file" .c)
+  for ((c = 0; c < ${#configs[@]}; c++)) ; do
+    config=${configs[$c]}
+    bin="$out/$name.$config"
+    if ! $clang ${flags[$c]} "$file" -o "$bin" 2> "$bin.log" ; then
+      echo "$name,$config,,,,build-failed"
+      echo "$name $config: build failed, see $bin.log" >&2
+      status=1
+      continue
+    fi
+    best=$(runBest "$bin" "$bin.out")
+    insts=$(countInsts "$bin" "$bin.perf")
+    output=same
+    if ! cmp -s "$bin.out" "$out/$name.O2.out" ; then
+      output=different
+      echo "$name $config: output differs from -O2" >&2
+      status=1
+    fi
+    echo "$name,$config,$(codeSize "$bin"),$best,$insts,$output"
+  done
+done
+exit $status
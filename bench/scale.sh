@@ -0,0 +1,48 @@
+#!/bin/bash
+# Compile-time scaling of LQICM: grow each parameter of the generated loop
+# nest, the others kept at their base value, and print one CSV row per run.
+#
+#   ./bench/scale.sh build/bench/lqicm-scale > scale.csv
+#
+# The budgets of the analysis are off, to see how it scales past them.
+# LQICM_SCALE_FLAGS replaces them, e.g. to time the default budgets:
+#
+#   LQICM_SCALE_FLAGS=" " ./bench/scale.sh build/bench/lqicm-scale
+
+scale=${1:-./build/bench/lqicm-scale}
+if ! [ -x "$scale" ] ; then
+  echo "usage: $0 path/to/lqicm-scale" >&2
+  exit 1
+fi
+
+flags=${LQICM_SCALE_FLAGS:-"-lqicm-max-loop-insts=0 -lqicm-max-variables=0 \
+-lqicm-max-arrows=0 -lqicm-max-fixpoint-rounds=0 -lqicm-max-dep-steps=0"}
+
+# Base point
+insts=64
+vars=4
+chain=2
+forks=1
+depth=1
+
+run() {
+  # A process per point, the peak memory is its own
+  $scale $flags "$@" || echo "lqicm-scale $* failed" >&2
+}
+
+$scale -csv-header
+for n in 16 32 64 128 256 512 1024 2048 4096 ; do
+  run -insts=$n -vars=$vars -chain=$chain -forks=$forks -depth=$depth
+done
+for n in 1 2 4 8 16 32 64 128 256 ; do
+  run -insts=$insts -vars=$n -chain=$chain -forks=$forks -depth=$depth
+done
+for n in 0 1 2 4 8 16 32 64 ; do
+  run -insts=$insts -vars=$vars -chain=$n -forks=$forks -depth=$depth
+done
+for n in 0 1 2 4 8 16 32 64 ; do
+  run -insts=$insts -vars=$vars -chain=$chain -forks=$n -depth=$depth
+done
+for n in 1 2 3 4 5 6 ; do
+  run -insts=$insts -vars=$vars -chain=$chain -forks=$forks -depth=$n
+done